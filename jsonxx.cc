@@ -12,8 +12,36 @@
 #include <iomanip>
 #include <sstream>
 #include <vector>
+#include <utility>
+#include <algorithm>
 #include <limits>
+#include <clocale>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <exception>
 #include <mutex>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSONXX_HAS_SSE2 1
+#include <emmintrin.h>
+#else
+#define JSONXX_HAS_SSE2 0
+#endif
+#if defined(__AVX2__)
+#define JSONXX_HAS_AVX2 1
+#include <immintrin.h>
+#else
+#define JSONXX_HAS_AVX2 0
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 // Snippet that creates an assertion function that works both in DEBUG & RELEASE mode.
 // JSONXX_ASSERT(...) macro will redirect to this. assert() macro is kept untouched.
@@ -42,1150 +70,4273 @@ namespace jsonxx {
 
 bool match(const char* pattern, std::istream& input);
 bool parse_array(std::istream& input, Array& array);
-bool parse_bool(std::istream& input, Boolean& value);
-bool parse_comment(std::istream &input);
-bool parse_null(std::istream& input);
 bool parse_number(std::istream& input, Number& value);
 bool parse_object(std::istream& input, Object& object);
 bool parse_string(std::istream& input, String& value);
-bool parse_identifier(std::istream& input, String& value);
 bool parse_value(std::istream& input, Value& value);
 
-// Try to consume characters from the input stream and match the
-// pattern string.
-bool match(const char* pattern, std::istream& input) {
-    input >> std::ws;
-    const char* cur(pattern);
-    char ch(0);
-    while(input && !input.eof() && *cur != 0) {
-        input.get(ch);
-        if (ch != *cur) {
-            input.putback(ch);
-            if( parse_comment(input) )
-                continue;
-            while (cur > pattern) {
-                cur--;
-                input.putback(*cur);
-            }
-            return false;
-        } else {
-            cur++;
-        }
+namespace {
+
+// Byte sources for the grammar routines. peek() and get() return the next
+// byte as 0..255, or -1 at the end of the input; skip() must only be called
+// after peek() returned a byte.
+class BufferReader {
+  public:
+    BufferReader( const char *data, size_t size ) : begin(data), cur(data), end(data + size) {}
+
+    int peek() const { return cur != end ? static_cast<unsigned char>(*cur) : -1; }
+    int get() { return cur != end ? static_cast<unsigned char>(*cur++) : -1; }
+    void skip() { ++cur; }
+    size_t offset() const { return static_cast<size_t>(cur - begin); }
+
+    // Only a ChunkReader runs dry before the end of the input.
+    size_t mark() const { return offset(); }
+    bool starved() const { return false; }
+    void rewind( size_t ) {}
+
+  private:
+    const char *begin, *cur, *end;
+};
+
+// Reads one piece of input that arrives in pieces. Running into the end of
+// a piece that is not the last leaves the reader starved: whatever was
+// being read must be read again once more input has been appended.
+class ChunkReader {
+  public:
+    ChunkReader() : begin(0), cur(0), end(0), last(false), hungry(false) {}
+
+    void reset( const char *data, size_t size, bool last_piece ) {
+        begin = cur = data;
+        end = data + size;
+        last = last_piece;
+        hungry = false;
     }
-    return *cur == 0;
-}
 
-bool parse_string(std::istream& input, String& value) {
-    char ch = '\0', delimiter = '"';
-    if (!match("\"", input))  {
-        if (parser_is_strict()) {
-            return false;
-        }
-        delimiter = '\'';
-        if (input.peek() != delimiter) {
-            return false;
-        }
-        input.get(ch);
+    int peek() {
+        if( cur != end ) return static_cast<unsigned char>(*cur);
+        hungry = !last;
+        return -1;
     }
-    while(!input.eof() && input.good()) {
-        input.get(ch);
-        if (ch == delimiter) {
-            break;
-        }
-        if (ch == '\\') {
-            input.get(ch);
-            switch(ch) {
-                case '\\':
-                case '/':
-                    value.push_back(ch);
-                    break;
-                case 'b':
-                    value.push_back('\b');
-                    break;
-                case 'f':
-                    value.push_back('\f');
-                    break;
-                case 'n':
-                    value.push_back('\n');
-                    break;
-                case 'r':
-                    value.push_back('\r');
-                    break;
-                case 't':
-                    value.push_back('\t');
-                    break;
-                case 'u': {
-                        int i;
-                        std::stringstream ss;
-                        for( i = 0; (!input.eof() && input.good()) && i < 4; ++i ) {
-                            input.get(ch);
-                            ss << std::hex << ch;
-                        }
-                        if( input.good() && (ss >> i) )
-                            value.push_back(static_cast<char>(i));
-                    }
-                    break;
-                default:
-                    if (ch != delimiter) {
-                        value.push_back('\\');
-                        value.push_back(ch);
-                    } else value.push_back(ch);
-                    break;
-            }
-        } else {
-            value.push_back(ch);
-        }
+    int get() {
+        if( cur != end ) return static_cast<unsigned char>(*cur++);
+        hungry = !last;
+        return -1;
     }
-    if (input && ch == delimiter) {
-        return true;
-    } else {
-        return false;
+    void skip() { ++cur; }
+    size_t offset() const { return static_cast<size_t>(cur - begin); }
+
+    // Marks a point to come back to, should the reader starve after it.
+    size_t mark() {
+        hungry = false;
+        return offset();
+    }
+    bool starved() const { return hungry; }
+    void rewind( size_t mark ) {
+        cur = begin + mark;
+        hungry = false;
     }
-}
 
-bool parse_identifier(std::istream& input, String& value) {
-    input >> std::ws;
+  private:
+    const char *begin, *cur, *end;
+    bool last, hungry;
+};
 
-    char ch = '\0', delimiter = ':';
-    bool first = true;
+// Reads straight from the stream buffer, so nothing is copied and the
+// stream is left positioned right after the last consumed byte.
+class StreamReader {
+  public:
+    explicit StreamReader( std::istream &input ) : buf( input ? input.rdbuf() : 0 ), consumed(0) {}
+
+    int peek() { return buf ? buf->sgetc() : -1; }
+    int get() {
+        int ch = buf ? buf->sbumpc() : -1;
+        if( ch >= 0 ) ++consumed;
+        return ch;
+    }
+    void skip() { buf->sbumpc(); ++consumed; }
+    size_t offset() const { return consumed; }
 
-    while(!input.eof() && input.good()) {
-        input.get(ch);
+    size_t mark() const { return offset(); }
+    bool starved() const { return false; }
+    void rewind( size_t ) {}
 
-        if (ch == delimiter) {
-            input.unget();
-            break;
-        }
+  private:
+    std::streambuf *buf;
+    size_t consumed;
+};
 
-        if(first) {
-            if ((ch != '_' && ch != '$') &&
-                    (ch < 'a' || ch > 'z') &&
-                    (ch < 'A' || ch > 'Z')) {
-                return false;
-            }
-            first = false;
-        }
-        if(ch == '_' || ch == '$' ||
-            (ch >= 'a' && ch <= 'z') ||
-            (ch >= 'A' && ch <= 'Z') ||
-            (ch >= '0' && ch <= '9')) {
-            value.push_back(ch);
-        }
-        else if(ch == '\t' || ch == ' ') {
-            input >> std::ws;
-        }
-    }
-    if (input && ch == delimiter) {
-        return true;
-    } else {
-        return false;
+// String sink for callers that only check the grammar.
+struct Discard {
+    void push_back( char ) {}
+    void clear() {}
+};
+
+// Collects the text of a number for conversion without touching the heap,
+// unless the number is unreasonably long.
+class NumberText {
+  public:
+    NumberText() : size(0) {}
+
+    void clear() {
+        size = 0;
+        spill.clear();
     }
-}
 
-class IOStateMasker {
-    public:
-    explicit IOStateMasker(std::istream& input): stream(input) {
-       mask = input.exceptions();
-       input.exceptions(std::istream::goodbit);
+    void push_back( char ch ) {
+        if( size < sizeof(text) - 1 )
+            text[ size++ ] = ch;
+        else
+            spill.push_back( ch );
     }
 
-    ~IOStateMasker() {
-        stream.exceptions(mask);
+    Number value() {
+        // strtold() honours the C locale, so speak its decimal point
+        const char point = *localeconv()->decimal_point;
+        for( size_t i = 0; i < size; ++i )
+            if( text[i] == '.' )
+                text[i] = point;
+        text[ size ] = '\0';
+        if( spill.empty() )
+            return std::strtold( text, 0 );
+        std::string all = text + spill;
+        for( size_t i = size; i < all.size(); ++i )
+            if( all[i] == '.' )
+                all[i] = point;
+        return std::strtold( all.c_str(), 0 );
     }
 
-    private:
-    std::istream& stream;
-    std::istream::iostate mask;
+  private:
+    char text[64];
+    size_t size;
+    std::string spill;
 };
 
-bool parse_number(std::istream& input, Number& value) {
-    input >> std::ws;
-    std::streampos rollback = input.tellg();
-    IOStateMasker masker(input);
-    input >> value;
-    if (input.fail()) {
-        input.clear();
-        input.seekg(rollback);
-        return false;
-    }
-    return true;
+inline bool is_space( int ch ) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\v' || ch == '\f';
 }
 
-bool parse_bool(std::istream& input, Boolean& value) {
-    if (match("true", input))  {
-        value = true;
-        return true;
-    }
-    if (match("false", input)) {
-        value = false;
-        return true;
-    }
-    return false;
+inline bool is_digit( int ch ) {
+    return ch >= '0' && ch <= '9';
 }
 
-bool parse_null(std::istream& input) {
-    if (match("null", input))  {
-        return true;
-    }
-    if (parser_is_strict()) {
-        return false;
+// Value of a hex digit, or -1.
+const signed char hex_digit[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 1_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 2_
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1, // 3_
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 4_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 5_
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 6_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 7_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 8_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 9_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // A_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // B_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // C_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // D_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // E_
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1  // F_
+};
+
+// Appends code point `code` (at most U+10FFFF) encoded as UTF-8.
+template<typename Output>
+inline void put_utf8( Output &out, unsigned code ) {
+    if( code < 0x80 ) {
+        out.push_back( static_cast<char>(code) );
+    } else if( code < 0x800 ) {
+        out.push_back( static_cast<char>(0xC0 | (code >> 6)) );
+        out.push_back( static_cast<char>(0x80 | (code & 0x3F)) );
+    } else if( code < 0x10000 ) {
+        out.push_back( static_cast<char>(0xE0 | (code >> 12)) );
+        out.push_back( static_cast<char>(0x80 | ((code >> 6) & 0x3F)) );
+        out.push_back( static_cast<char>(0x80 | (code & 0x3F)) );
+    } else {
+        out.push_back( static_cast<char>(0xF0 | (code >> 18)) );
+        out.push_back( static_cast<char>(0x80 | ((code >> 12) & 0x3F)) );
+        out.push_back( static_cast<char>(0x80 | ((code >> 6) & 0x3F)) );
+        out.push_back( static_cast<char>(0x80 | (code & 0x3F)) );
     }
-    return (input.peek()==',');
 }
 
-bool parse_array(std::istream& input, Array& array) {
-    return array.parse(input);
-}
+// UTF-8 lead bytes by class: how many continuation bytes follow and the
+// range the first of them must fall in, which rules out overlong forms,
+// surrogates and code points past U+10FFFF (RFC 3629, section 4).
+const unsigned char utf8_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 4, 4, 6, 7, 7, 7, 8, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+const struct { unsigned char follow, lo, hi; } utf8_rule[9] = {
+    { 0, 0x00, 0x00 }, { 0, 0x00, 0x00 }, { 1, 0x80, 0xBF }, { 2, 0xA0, 0xBF }, { 2, 0x80, 0xBF },
+    { 2, 0x80, 0x9F }, { 3, 0x90, 0xBF }, { 3, 0x80, 0xBF }, { 3, 0x80, 0x8F }
+};
 
-bool parse_object(std::istream& input, Object& object) {
-    return object.parse(input);
+// False if byte cannot lead a multibyte sequence.
+inline bool utf8_lead( unsigned char byte, int &follow, unsigned char &lo, unsigned char &hi ) {
+    const unsigned char c = utf8_class[ byte ];
+    follow = utf8_rule[c].follow, lo = utf8_rule[c].lo, hi = utf8_rule[c].hi;
+    return follow != 0;
 }
 
-bool parse_comment(std::istream &input) {
-    if( parser_is_permissive() )
-    if( !input.eof() && input.peek() == '/' )
-    {
-        char ch0(0);
-        input.get(ch0);
-
-        if( !input.eof() )
-        {
-            char ch1(0);
-            input.get(ch1);
-
-            if( ch0 == '/' && ch1 == '/' )
-            {
-                // trim chars till \r or \n
-                for( char ch(0); !input.eof() && (input.peek() != '\r' && input.peek() != '\n'); )
-                    input.get(ch);
-
-                // consume spaces, tabs, \r or \n, in case no eof is found
-                if( !input.eof() )
-                    input >> std::ws;
-                return true;
-            }
-
-            input.unget();
-            input.clear();
+// Length of the longest well-formed UTF-8 prefix of data. Runs of ASCII are
+// skipped 16 bytes at a time where SSE2 is available.
+size_t utf8_prefix( const char *data, size_t size ) {
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(data);
+    size_t i = 0;
+    while( i < size ) {
+        if( s[i] < 0x80 ) {
+#if JSONXX_HAS_SSE2
+            while( i + 16 <= size &&
+                   !_mm_movemask_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>(s + i) ) ) )
+                i += 16;
+            if( i == size || s[i] >= 0x80 )
+                continue;
+#endif
+            ++i;
+            continue;
         }
-
-        input.unget();
-        input.clear();
+        int follow;
+        unsigned char lo, hi;
+        if( !utf8_lead( s[i], follow, lo, hi ) || size - i <= size_t(follow) )
+            return i;
+        for( int n = 1; n <= follow; ++n, lo = 0x80, hi = 0xBF )
+            if( s[i + n] < lo || s[i + n] > hi )
+                return i;
+        i += follow + 1;
     }
+    return size;
+}
 
-    return false;
+inline bool is_utf8( const String &text ) {
+    return utf8_prefix( text.data(), text.size() ) == text.size();
 }
 
-bool parse_value(std::istream& input, Value& value) {
-    return value.parse(input);
+inline bool is_utf8( const Discard & ) {
+    return true;
 }
 
+// Text sink that checks UTF-8 a byte at a time, for validate().
+class Utf8Sink {
+  public:
+    Utf8Sink() { clear(); }
+    void clear() {
+        follow = 0, good = true;
+    }
+    void push_back( char c ) {
+        const unsigned char byte = static_cast<unsigned char>(c);
+        if( follow ) {
+            good = good && byte >= lo && byte <= hi;
+            lo = 0x80, hi = 0xBF;
+            --follow;
+        } else if( byte >= 0x80 ) {
+            good = good && utf8_lead( byte, follow, lo, hi );
+        }
+    }
+    bool valid() const { return good && !follow; }
+  private:
+    int follow;
+    unsigned char lo, hi;
+    bool good;
+};
 
-Object::Object() : value_map_() {}
+inline bool is_utf8( const Utf8Sink &text ) {
+    return text.valid();
+}
 
-Object::~Object() {
-    reset();
+// Index of the lowest set bit; bits must not be zero.
+inline unsigned lowest_bit( unsigned bits ) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward( &index, bits );
+    return index;
+#else
+    return __builtin_ctz( bits );
+#endif
 }
 
-bool Object::parse(std::istream& input, Object& object) {
-    object.reset();
+// Writers put their output through a sink: anything with
+// write(const char *, size_t).
+class StringSink {
+  public:
+    explicit StringSink( std::string &output ) : out(output), start(output.size()) {}
+    void write( const char *data, size_t size ) { out.append( data, size ); }
+    void put( char c ) { out.push_back( c ); }
+    size_t written() const { return out.size() - start; }
+  private:
+    std::string &out;
+    const size_t start;
+};
 
-    if (!match("{", input)) {
-        return false;
-    }
-    if (match("}", input)) {
-        return true;
-    }
+class StreamSink {
+  public:
+    explicit StreamSink( std::ostream &output ) : out(output) {}
+    void write( const char *data, size_t size ) { out.write( data, size ); }
+    void put( char c ) { out.put( c ); }
+  private:
+    std::ostream &out;
+};
 
-    do {
-        std::string key;
-        if (unquoted_keys_are_enabled()) {
-            if (!parse_identifier(input, key)) {
-                if (parser_is_permissive()) {
-                    if (input.peek() == '}')
-                        break;
-                }
-                return false;
-            }
-        }
-        else {
-            if (!parse_string(input, key)) {
-                if (parser_is_permissive()) {
-                    if (input.peek() == '}')
-                        break;
-                }
-                return false;
+// For whole documents: collects output in a block and hands it to the
+// stream buffer a block at a time. Nothing else may write to the stream
+// until the sink is flushed or destroyed.
+class BufferedSink {
+  public:
+    explicit BufferedSink( std::ostream &output ) : out(output), size(0), flushed(0) {}
+    ~BufferedSink() { flush(); }
+    void write( const char *data, size_t n ) {
+        if( size + n > sizeof(block) ) {
+            flush();
+            if( n > sizeof(block) ) {
+                drain( data, n );
+                return;
             }
         }
-        if (!match(":", input)) {
-            return false;
-        }
-        Value* v = new Value();
-        if (!parse_value(input, *v)) {
-            delete v;
-            break;
-        }
-        // TODO(hjiang): Add an option to allow duplicated keys?
-        if (object.value_map_.find(key) == object.value_map_.end()) {
-          object.value_map_[key] = v;
-        } else {
-          if (parser_is_permissive()) {
-            delete object.value_map_[key];
-            object.value_map_[key] = v;
-          } else {
-            delete v;
-            return false;
-          }
+        std::memcpy( block + size, data, n );
+        size += n;
+    }
+    void put( char c ) {
+        if( size == sizeof(block) )
+            flush();
+        block[ size++ ] = c;
+    }
+    void flush() {
+        drain( block, size );
+        size = 0;
+    }
+    size_t written() const { return flushed + size; }
+  private:
+    void drain( const char *data, size_t n ) {
+        if( n && out.rdbuf()->sputn( data, n ) != std::streamsize(n) )
+            out.setstate( std::ios::badbit );
+        flushed += n;
+    }
+    std::ostream &out;
+    char block[ 16 * 1024 ];
+    size_t size, flushed;
+};
+
+// Calls task(i) for every i below tasks on up to `threads` threads, the
+// calling one included. The first exception thrown stops handing out
+// tasks and is rethrown here once all threads are done.
+template<typename Task>
+void run_parallel( unsigned threads, size_t tasks, Task task ) {
+    std::atomic<size_t> next( 0 );
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&]() {
+        try {
+            for( size_t i; (i = next++) < tasks; )
+                task( i );
+        } catch( ... ) {
+            std::lock_guard<std::mutex> lock( error_mutex );
+            if( !error )
+                error = std::current_exception();
+            next = tasks;
         }
-    } while (match(",", input));
+    };
+    std::vector<std::thread> workers;
+    for( unsigned t = 1; t < threads && t < tasks; ++t )
+        workers.push_back( std::thread( work ) );
+    work();
+    for( size_t t = 0; t < workers.size(); ++t )
+        workers[t].join();
+    if( error )
+        std::rethrow_exception( error );
+}
 
+// Threads to use when 0 asks for one per core.
+inline unsigned thread_count( unsigned threads ) {
+    if( !threads )
+        threads = std::thread::hardware_concurrency();
+    return threads ? threads : 1;
+}
 
-    if (!match("}", input)) {
-        return false;
-    }
+// Escape tables: the replacement text for each byte, built at compile
+// time. A size of zero means the byte is copied as is.
+struct Escape {
+    unsigned char size;
+    char text[7];
+};
 
-    return true;
+#define JSONXX_ROW(f, r) \
+    f(r+0x0), f(r+0x1), f(r+0x2), f(r+0x3), f(r+0x4), f(r+0x5), f(r+0x6), f(r+0x7), \
+    f(r+0x8), f(r+0x9), f(r+0xA), f(r+0xB), f(r+0xC), f(r+0xD), f(r+0xE), f(r+0xF)
+#define JSONXX_TABLE(f) { \
+    JSONXX_ROW(f, 0x00), JSONXX_ROW(f, 0x10), JSONXX_ROW(f, 0x20), JSONXX_ROW(f, 0x30), \
+    JSONXX_ROW(f, 0x40), JSONXX_ROW(f, 0x50), JSONXX_ROW(f, 0x60), JSONXX_ROW(f, 0x70), \
+    JSONXX_ROW(f, 0x80), JSONXX_ROW(f, 0x90), JSONXX_ROW(f, 0xA0), JSONXX_ROW(f, 0xB0), \
+    JSONXX_ROW(f, 0xC0), JSONXX_ROW(f, 0xD0), JSONXX_ROW(f, 0xE0), JSONXX_ROW(f, 0xF0) }
+
+constexpr char hex_char( unsigned n ) {
+    return static_cast<char>( n < 10 ? '0' + n : 'a' + n - 10 );
 }
 
-Value::Value() : type_(INVALID_) {}
+// '/' is escaped too, as jsonxx always has.
+constexpr Escape json_escape_of( unsigned c ) {
+    return c == '"'  ? Escape{ 2, { '\\', '"' } } :
+           c == '\\' ? Escape{ 2, { '\\', '\\' } } :
+           c == '/'  ? Escape{ 2, { '\\', '/' } } :
+           c == '\b' ? Escape{ 2, { '\\', 'b' } } :
+           c == '\f' ? Escape{ 2, { '\\', 'f' } } :
+           c == '\n' ? Escape{ 2, { '\\', 'n' } } :
+           c == '\r' ? Escape{ 2, { '\\', 'r' } } :
+           c == '\t' ? Escape{ 2, { '\\', 't' } } :
+           c < 0x20  ? Escape{ 6, { '\\', 'u', '0', '0', hex_char( c >> 4 ), hex_char( c & 15 ) } } :
+                       Escape{ 0, { 0 } };
+}
 
-void Value::reset() {
-    if (type_ == STRING_) {
-        delete string_value_;
-        string_value_ = 0;
-    }
-    else if (type_ == OBJECT_) {
-        delete object_value_;
-        object_value_ = 0;
-    }
-    else if (type_ == ARRAY_) {
-        delete array_value_;
-        array_value_ = 0;
-    }
+// Text content in every XML format; '&' is left alone only for unknown
+// formats, as it always was.
+template<unsigned Format>
+constexpr Escape xml_escape_of( unsigned c ) {
+    return c == '<' ? Escape{ 4, { '&', 'l', 't', ';' } } :
+           c == '>' ? Escape{ 4, { '&', 'g', 't', ';' } } :
+           c == '&' && Format >= jsonxx::JSONx && Format <= jsonxx::TaggedXML
+                    ? Escape{ 5, { '&', 'a', 'm', 'p', ';' } } :
+                      Escape{ 0, { 0 } };
 }
 
-bool Value::parse(std::istream& input, Value& value) {
-    value.reset();
+// Element and attribute names keep [A-Za-z0-9]; anything else becomes '_'.
+constexpr char xml_name_char_of( unsigned c ) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+         ? static_cast<char>(c) : '_';
+}
 
-    std::string string_value;
-    if (parse_string(input, string_value)) {
-        value.string_value_ = new std::string();
-        value.string_value_->swap(string_value);
-        value.type_ = STRING_;
-        return true;
+constexpr Escape json_escapes[256] = JSONXX_TABLE( json_escape_of );
+
+// Indexed by format; entry 0 serves unknown formats.
+constexpr Escape xml_escapes[5][256] = {
+    JSONXX_TABLE( xml_escape_of<0> ),
+    JSONXX_TABLE( xml_escape_of<jsonxx::JSONx> ),
+    JSONXX_TABLE( xml_escape_of<jsonxx::JXML> ),
+    JSONXX_TABLE( xml_escape_of<jsonxx::JXMLex> ),
+    JSONXX_TABLE( xml_escape_of<jsonxx::TaggedXML> ),
+};
+
+constexpr char xml_name_chars[256] = JSONXX_TABLE( xml_name_char_of );
+
+#undef JSONXX_TABLE
+#undef JSONXX_ROW
+
+// Length of the leading run of data that needs no escaping, scanned 32 or
+// 16 bytes at a time where AVX2 or SSE2 is available.
+inline size_t json_clean_run( const char *data, size_t size ) {
+    size_t i = 0;
+#if JSONXX_HAS_AVX2
+    {
+        const __m256i quote = _mm256_set1_epi8( '"' ), backslash = _mm256_set1_epi8( '\\' );
+        const __m256i slash = _mm256_set1_epi8( '/' ), control = _mm256_set1_epi8( 0x1F );
+        for( ; i + 32 <= size; i += 32 ) {
+            const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i *>(data + i) );
+            const __m256i hits = _mm256_or_si256(
+                _mm256_or_si256( _mm256_cmpeq_epi8( v, quote ), _mm256_cmpeq_epi8( v, backslash ) ),
+                _mm256_or_si256( _mm256_cmpeq_epi8( v, slash ),
+                                 _mm256_cmpeq_epi8( _mm256_min_epu8( v, control ), v ) ) );
+            const unsigned bits = static_cast<unsigned>( _mm256_movemask_epi8( hits ) );
+            if( bits )
+                return i + lowest_bit( bits );
+        }
     }
-    if (parse_number(input, value.number_value_)) {
-        value.type_ = NUMBER_;
-        return true;
+#endif
+#if JSONXX_HAS_SSE2
+    {
+        const __m128i quote = _mm_set1_epi8( '"' ), backslash = _mm_set1_epi8( '\\' );
+        const __m128i slash = _mm_set1_epi8( '/' ), control = _mm_set1_epi8( 0x1F );
+        for( ; i + 16 <= size; i += 16 ) {
+            const __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>(data + i) );
+            const __m128i hits = _mm_or_si128(
+                _mm_or_si128( _mm_cmpeq_epi8( v, quote ), _mm_cmpeq_epi8( v, backslash ) ),
+                _mm_or_si128( _mm_cmpeq_epi8( v, slash ),
+                              _mm_cmpeq_epi8( _mm_min_epu8( v, control ), v ) ) );
+            const unsigned bits = static_cast<unsigned>( _mm_movemask_epi8( hits ) );
+            if( bits )
+                return i + lowest_bit( bits );
+        }
     }
+#endif
+    while( i < size && !json_escapes[ static_cast<unsigned char>(data[i]) ].size )
+        ++i;
+    return i;
+}
 
-    if (parse_bool(input, value.bool_value_)) {
-        value.type_ = BOOL_;
-        return true;
-    }
-    if (parse_null(input)) {
-        value.type_ = NULL_;
-        return true;
+// Writes the body of a JSON string (no quotes): clean runs are copied
+// whole, the bytes in between are escaped.
+template<typename Sink>
+void escape_json( Sink &out, const char *data, size_t size ) {
+    for(;;) {
+        const size_t clean = json_clean_run( data, size );
+        if( clean )
+            out.write( data, clean );
+        if( clean == size )
+            return;
+        const Escape &escape = json_escapes[ static_cast<unsigned char>(data[clean]) ];
+        out.write( escape.text, escape.size );
+        data += clean + 1;
+        size -= clean + 1;
     }
-    if (input.peek() == '[') {
-        value.array_value_ = new Array();
-        if (parse_array(input, *value.array_value_)) {
-            value.type_ = ARRAY_;
-            return true;
+}
+
+template<typename Sink>
+void escape_json( Sink &out, const std::string &text ) {
+    escape_json( out, text.data(), text.size() );
+}
+
+// Writes XML text content escaped for format.
+template<typename Sink>
+void escape_xml( Sink &out, const std::string &text, unsigned format ) {
+    const Escape *table = xml_escapes[ format < 5 ? format : 0 ];
+    const char *data = text.data(), *end = data + text.size(), *run = data;
+    for( ; data != end; ++data ) {
+        const Escape &escape = table[ static_cast<unsigned char>(*data) ];
+        if( escape.size ) {
+            out.write( run, data - run );
+            out.write( escape.text, escape.size );
+            run = data + 1;
         }
-        delete value.array_value_;
-        value.array_value_ = 0;
     }
-    value.object_value_ = new Object();
-    if (parse_object(input, *value.object_value_)) {
-        value.type_ = OBJECT_;
-        return true;
-    }
-    delete value.object_value_;
-    value.object_value_ = 0;
-    return false;
+    out.write( run, data - run );
+}
+
+inline bool is_identifier_char( int ch, bool first ) {
+    return ch == '_' || ch == '$' ||
+           (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+           (!first && is_digit(ch));
 }
 
-Array::Array() : values_() {}
+// What the first significant byte of a value says about it.
+enum Lead {
+    XX,         // cannot start a value
+    DQ, SQ,     // "string", 'string'
+    NU,         // number
+    TR, FA, NL, // true, false, null
+    AR, OB,     // [array], {object}
+    CM          // omitted value before a ','
+};
 
-Array::~Array() {
-    reset();
+const unsigned char lead[256] = {
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // 0_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // 1_
+    XX, XX, DQ, XX, XX, XX, XX, SQ, XX, XX, XX, NU, CM, NU, NU, XX, // 2_
+    NU, NU, NU, NU, NU, NU, NU, NU, NU, NU, XX, XX, XX, XX, XX, XX, // 3_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // 4_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, AR, XX, XX, XX, XX, // 5_
+    XX, XX, XX, XX, XX, XX, FA, XX, XX, XX, XX, XX, XX, XX, NL, XX, // 6_
+    XX, XX, XX, XX, TR, XX, XX, XX, XX, XX, XX, OB, XX, XX, XX, XX, // 7_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // 8_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // 9_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // A_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // B_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // C_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // D_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, // E_
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX  // F_
+};
+
+// Lead of the next byte; the end of the input cannot start a value.
+template<typename Reader>
+inline int lead_of( Reader &in ) {
+    const int ch = in.peek();
+    return ch < 0 ? XX : lead[ ch ];
 }
 
-bool Array::parse(std::istream& input, Array& array) {
-    array.reset();
+// Compile-time parser settings. Every grammar routine below is templated on
+// a Policy, so each combination of settings gets its own branch-free code.
+template<bool Permissive, bool Unquoted, bool Comments>
+struct Policy {
+    static const bool permissive = Permissive;       // see ParseOptions
+    static const bool unquoted_keys = Unquoted;
+    static const bool comments = Comments;
+};
 
-    if (!match("[", input)) {
-        return false;
-    }
-    if (match("]", input)) {
-        return true;
+typedef Policy<Parser == Permissive, UnquotedKeys == Enabled, Parser == Permissive> DefaultPolicy;
+
+// Runs task.run<P>() with the Policy P matching the runtime options.
+template<typename Task>
+bool dispatch( const ParseOptions &options, Task &task ) {
+    switch( (options.permissive ? 4 : 0) | (options.unquoted_keys ? 2 : 0) | (options.comments ? 1 : 0) ) {
+        default:
+        case 0: return task.template run< Policy<false, false, false> >();
+        case 1: return task.template run< Policy<false, false, true > >();
+        case 2: return task.template run< Policy<false, true,  false> >();
+        case 3: return task.template run< Policy<false, true,  true > >();
+        case 4: return task.template run< Policy<true,  false, false> >();
+        case 5: return task.template run< Policy<true,  false, true > >();
+        case 6: return task.template run< Policy<true,  true,  false> >();
+        case 7: return task.template run< Policy<true,  true,  true > >();
     }
+}
 
-    do {
-        Value* v = new Value();
-        if (!parse_value(input, *v)) {
-            delete v;
-            break;
+// Skips whitespace and, in permissive mode, // comments. Fails on a lone '/'.
+template<typename P, typename Reader>
+bool skip_space( Reader &in ) {
+    for(;;) {
+        int ch = in.peek();
+        if( is_space(ch) ) {
+            in.skip();
+        } else if( ch == '/' && P::comments ) {
+            in.skip();
+            if( in.peek() != '/' )
+                return false;
+            while( (ch = in.peek()) >= 0 && ch != '\r' && ch != '\n' )
+                in.skip();
+        } else {
+            return true;
         }
-        array.values_.push_back(v);
-    } while (match(",", input));
+    }
+}
 
-    if (!match("]", input)) {
-        return false;
+// Reads four hex digits.
+template<typename Reader>
+bool scan_hex4( Reader &in, unsigned &code ) {
+    code = 0;
+    for( int i = 0; i < 4; ++i ) {
+        // the end of input (-1) maps to 0xFF, which is not a digit
+        const int digit = hex_digit[ static_cast<unsigned char>( in.peek() ) ];
+        if( digit < 0 )
+            return false;
+        code = code << 4 | digit;
+        in.skip();
     }
     return true;
 }
 
-static std::ostream& stream_string(std::ostream& stream,
-                                   const std::string& string) {
-    stream << '"';
-    for (std::string::const_iterator i = string.begin(),
-                 e = string.end(); i != e; ++i) {
-        switch (*i) {
+// Told of every escape sequence scan_string() decodes. Only the text a
+// Census counts into does anything with it.
+template<typename Output>
+inline void note_escape( Output & ) {}
+
+// Reads a quoted string, the reader sitting on the opening quote. Leaves
+// the reader on the offending byte when the string is malformed.
+//
+// \uXXXX escapes are decoded to UTF-8, surrogate pairs included; a lone
+// surrogate decodes to U+FFFD, so the result is always valid UTF-8 as long
+// as the raw bytes are.
+template<typename P, typename Reader, typename Output>
+bool scan_string( Reader &in, Output &out ) {
+    const int delimiter = in.get();
+    unsigned high = 0;  // high surrogate waiting for its low half
+    for(;;) {
+        int ch = in.peek();
+        if( ch < 0 || (ch < 0x20 && !P::permissive) ) {
+            return false;
+        }
+        in.skip();
+        if( ch == '\\' && in.peek() == 'u' ) {
+            unsigned code;
+            in.skip();
+            note_escape( out );
+            if( !scan_hex4(in, code) )
+                return false;
+            if( code >= 0xDC00 && code <= 0xDFFF && high ) {
+                code = 0x10000 + ((high - 0xD800) << 10) + (code - 0xDC00);
+                high = 0;
+            } else {
+                if( high )
+                    put_utf8( out, 0xFFFD );
+                high = 0;
+                if( code >= 0xD800 && code <= 0xDBFF ) {
+                    high = code;
+                    continue;
+                }
+                if( code >= 0xDC00 && code <= 0xDFFF )
+                    code = 0xFFFD;
+            }
+            put_utf8( out, code );
+            continue;
+        }
+        if( high ) {
+            put_utf8( out, 0xFFFD );
+            high = 0;
+        }
+        if( ch == delimiter ) {
+            return true;
+        }
+        if( ch != '\\' ) {
+            out.push_back( static_cast<char>(ch) );
+            continue;
+        }
+        note_escape( out );
+        switch( ch = in.peek() ) {
             case '"':
-                stream << "\\\"";
-                break;
             case '\\':
-                stream << "\\\\";
-                break;
             case '/':
-                stream << "\\/";
+                out.push_back( static_cast<char>(ch) );
                 break;
-            case '\b':
-                stream << "\\b";
+            case 'b':
+                out.push_back('\b');
                 break;
-            case '\f':
-                stream << "\\f";
+            case 'f':
+                out.push_back('\f');
                 break;
-            case '\n':
-                stream << "\\n";
+            case 'n':
+                out.push_back('\n');
                 break;
-            case '\r':
-                stream << "\\r";
+            case 'r':
+                out.push_back('\r');
                 break;
-            case '\t':
-                stream << "\\t";
+            case 't':
+                out.push_back('\t');
                 break;
             default:
-                if (*i < 32) {
-                    stream << "\\u" << std::hex << std::setw(4) <<
-                            std::setfill('0') << static_cast<int>(*i) << std::dec <<
-                            std::setw(0);
-                } else {
-                    stream << *i;
-                }
+                if( ch < 0 || (ch != delimiter && !P::permissive) )
+                    return false;
+                if( ch != delimiter )
+                    out.push_back('\\');
+                out.push_back( static_cast<char>(ch) );
+                break;
         }
+        in.skip();
     }
-    stream << '"';
-    return stream;
 }
 
-}  // namespace jsonxx
+template<typename Reader, typename Output>
+bool scan_identifier( Reader &in, Output &out ) {
+    if( !is_identifier_char( in.peek(), true ) )
+        return false;
+    do out.push_back( static_cast<char>( in.get() ) );
+    while( is_identifier_char( in.peek(), false ) );
+    return true;
+}
 
-std::ostream& operator<<(std::ostream& stream, const jsonxx::Value& v) {
-    using namespace jsonxx;
-    if (v.is<Number>()) {
-        return stream << v.get<Number>();
-    } else if (v.is<String>()) {
-        return stream_string(stream, v.get<std::string>());
-    } else if (v.is<Boolean>()) {
-        if (v.get<Boolean>()) {
-            return stream << "true";
-        } else {
-            return stream << "false";
-        }
-    } else if (v.is<Null>()) {
-        return stream << "null";
-    } else if (v.is<Object>()) {
-        return stream << v.get<Object>();
-    } else if (v.is<Array>()){
-        return stream << v.get<Array>();
+// Accepts what `istream >> Number` accepts: an optional sign, digits with
+// an optional fraction, and an optional exponent.
+template<typename Reader, typename Output>
+bool scan_number( Reader &in, Output &out ) {
+    bool digits = false;
+    if( in.peek() == '+' || in.peek() == '-' )
+        out.push_back( static_cast<char>( in.get() ) );
+    for( ; is_digit( in.peek() ); digits = true )
+        out.push_back( static_cast<char>( in.get() ) );
+    if( in.peek() == '.' ) {
+        out.push_back( static_cast<char>( in.get() ) );
+        for( ; is_digit( in.peek() ); digits = true )
+            out.push_back( static_cast<char>( in.get() ) );
     }
-    // Shouldn't reach here.
-    return stream;
+    if( !digits )
+        return false;
+    if( in.peek() == 'e' || in.peek() == 'E' ) {
+        out.push_back( static_cast<char>( in.get() ) );
+        if( in.peek() == '+' || in.peek() == '-' )
+            out.push_back( static_cast<char>( in.get() ) );
+        if( !is_digit( in.peek() ) )
+            return false;
+        do out.push_back( static_cast<char>( in.get() ) );
+        while( is_digit( in.peek() ) );
+    }
+    return true;
 }
 
-std::ostream& operator<<(std::ostream& stream, const jsonxx::Array& v) {
-    stream << "[";
-    jsonxx::Array::container::const_iterator
-        it = v.values().begin(),
-        end = v.values().end();
-    while (it != end) {
-        stream << *(*it);
-        ++it;
-        if (it != end) {
-            stream << ", ";
-        }
+template<typename Reader>
+bool scan_literal( Reader &in, const char *literal ) {
+    for( ; *literal; ++literal ) {
+        if( in.peek() != *literal )
+            return false;
+        in.skip();
     }
-    return stream << "]";
+    return true;
 }
 
-std::ostream& operator<<(std::ostream& stream, const jsonxx::Object& v) {
-    stream << "{";
-    jsonxx::Object::container::const_iterator
-        it = v.kv_map().begin(),
-        end = v.kv_map().end();
-    while (it != end) {
-        jsonxx::stream_string(stream, it->first);
-        stream << ": " << *(it->second);
-        ++it;
-        if (it != end) {
-            stream << ", ";
-        }
-    }
-    return stream << "}";
+// A key is a quoted string or, when enabled, a bare identifier.
+template<typename P, typename Reader, typename Output>
+bool scan_key( Reader &in, Output &out ) {
+    const int ch = in.peek();
+    if( ch == '"' || (ch == '\'' && P::permissive) )
+        return scan_string<P>( in, out );
+    return P::unquoted_keys && scan_identifier( in, out );
 }
 
+} // namespace jsonxx::anon
 
-namespace jsonxx {
-namespace {
+// Try to consume characters from the input stream and match the
+// pattern string.
+bool match(const char* pattern, std::istream& input) {
+    StreamReader in( input );
+    return skip_space<DefaultPolicy>(in) && scan_literal(in, pattern);
+}
 
-typedef unsigned char byte;
+bool parse_string(std::istream& input, String& value) {
+    StreamReader in( input );
+    if( !skip_space<DefaultPolicy>(in) )
+        return false;
+    const int ch = in.peek();
+    if( ch != '"' && (ch != '\'' || !DefaultPolicy::permissive) )
+        return false;
+    return scan_string<DefaultPolicy>(in, value);
+}
 
-//template<bool quote>
-std::string escape_string( const std::string &input, const bool quote = false ) {
-    static std::string map[256], *once = 0;
-    static std::mutex mutex;
-    if( !once ) {
-        // The problem here is that, once is initializing at the end of job, but if multithreaded application is starting this for the first time
-        // it will jump into this part with several threads and cause double free or corruptions.
-        // To prevent it, it is required to have mutex, to lock other threads while only one of them is constructing the static map.
-        mutex.lock();
-        if (!once) {
-            // base
-            for( int i = 0; i < 256; ++i ) {
-                map[ i ] = std::string() + char(i);
-            }
-            // non-printable
-            for( int i = 0; i < 32; ++i ) {
-                std::stringstream str;
-                str << "\\u" << std::hex << std::setw(4) << std::setfill('0') << i;
-                map[ i ] = str.str();
-            }
-            // exceptions
-            map[ byte('"') ] = "\\\"";
-            map[ byte('\\') ] = "\\\\";
-            map[ byte('/') ] = "\\/";
-            map[ byte('\b') ] = "\\b";
-            map[ byte('\f') ] = "\\f";
-            map[ byte('\n') ] = "\\n";
-            map[ byte('\r') ] = "\\r";
-            map[ byte('\t') ] = "\\t";
+bool parse_number(std::istream& input, Number& value) {
+    StreamReader in( input );
+    NumberText text;
+    if( !skip_space<DefaultPolicy>(in) || !scan_number(in, text) )
+        return false;
+    value = text.value();
+    return true;
+}
 
-            once = map;
-        }
-        mutex.unlock();
-    }
-    std::string output;
-    output.reserve( input.size() * 2 + 2 ); // worst scenario
-    if( quote ) output += '"';
-    for( std::string::const_iterator it = input.begin(), end = input.end(); it != end; ++it )
-        output += map[ byte(*it) ];
-    if( quote ) output += '"';
-    return output;
+bool parse_array(std::istream& input, Array& array) {
+    return array.parse(input);
 }
 
+bool parse_object(std::istream& input, Object& object) {
+    return object.parse(input);
+}
 
-namespace json {
+bool parse_value(std::istream& input, Value& value) {
+    return value.parse(input);
+}
 
-    std::string remove_last_comma( const std::string &_input ) {
-        std::string input( _input );
-        size_t size = input.size();
-        if( size > 2 )
-            if( input[ size - 2 ] == ',' )
-                input[ size - 2 ] = ' ';
-        return input;
+// The members of an object or the elements of an array, shared by its
+// copies. Values reachable from a body with more than one reference are
+// never changed: the first change makes a copy of the body, which shares
+// in turn the containers below it.
+template<typename Container>
+struct Shared {
+    Shared() : refs(1), leaked(false), hash(0) {}
+    std::atomic<long> refs;
+    // References into it were handed out, so copies get their own values.
+    // Never cleared: the references stay good as long as the values do.
+    bool leaked;
+    std::atomic<size_t> hash;  // of the values, once known; 0 until then
+    Container values;
+};
+struct Object::Body : Shared<Object::container> {};
+struct Array::Body : Shared<Array::container> {};
+
+// Gives the readers below access to container internals, so parsed values
+// are adopted rather than copied.
+struct Internal {
+    static Object::container &members( Object &object ) { return object.unshare(); }
+    static Array::container &elements( Array &array ) { return array.unshare(); }
+    // The values only this container refers to, ready to be taken apart;
+    // 0 if it has none or shares them.
+    static Object::container *sole( Object &object ) {
+        return object.body_ && object.body_->refs == 1 ? &object.body_->values : 0;
     }
+    static Array::container *sole( Array &array ) {
+        return array.body_ && array.body_->refs == 1 ? &array.body_->values : 0;
+    }
+    // Where the hash of a container's values is kept, or 0 if it cannot
+    // be: there are no values, or references handed out may change them
+    // unseen.
+    static std::atomic<size_t> *hash_slot( const Object &object ) {
+        return object.body_ && !object.body_->leaked ? &object.body_->hash : 0;
+    }
+    static std::atomic<size_t> *hash_slot( const Array &array ) {
+        return array.body_ && !array.body_->leaked ? &array.body_->hash : 0;
+    }
+    // Whether references handed out may change a container's values.
+    static bool leaked( const Object &object ) {
+        return object.body_ && object.body_->leaked;
+    }
+    static bool leaked( const Array &array ) {
+        return array.body_ && array.body_->leaked;
+    }
+    // The block holding a container's values, 0 if it has none; size
+    // receives its size, and shared whether copies hold it too.
+    static const void *body( const Object &object, size_t &size, bool &shared ) {
+        size = sizeof( Object::Body );
+        shared = object.body_ && object.body_->refs.load( std::memory_order_relaxed ) > 1;
+        return object.body_;
+    }
+    static const void *body( const Array &array, size_t &size, bool &shared ) {
+        size = sizeof( Array::Body );
+        shared = array.body_ && array.body_->refs.load( std::memory_order_relaxed ) > 1;
+        return array.body_;
+    }
+    // Shares from's values with to, which holds none yet; false if to must
+    // have copies of them instead, because references into them were
+    // handed out.
+    static bool adopt( Object &to, const Object &from ) {
+        if( !from.body_ )
+            return true;
+        if( from.body_->leaked )
+            return false;
+        ++from.body_->refs;
+        to.body_ = from.body_;
+        to.value_map_ = &to.body_->values;
+        return true;
+    }
+    static bool adopt( Array &to, const Array &from ) {
+        if( !from.body_ )
+            return true;
+        if( from.body_->leaked )
+            return false;
+        ++from.body_->refs;
+        to.body_ = from.body_;
+        to.values_ = &to.body_->values;
+        return true;
+    }
+    static void swap( Object &a, Object &b ) {
+        std::swap( a.body_, b.body_ );
+        std::swap( a.value_map_, b.value_map_ );
+    }
+    static void swap( Array &a, Array &b ) {
+        std::swap( a.body_, b.body_ );
+        std::swap( a.values_, b.values_ );
+    }
+};
 
-    std::string tag( unsigned format, unsigned depth, const std::string &name, const jsonxx::Value &t) {
-        std::stringstream ss;
-        const std::string tab(depth, '\t');
-
-        if( !name.empty() )
-            ss << tab << '\"' << escape_string( name ) << '\"' << ':' << ' ';
-        else
-            ss << tab;
+namespace {
 
-        switch( t.type_ )
-        {
-            default:
-            case jsonxx::Value::NULL_:
-                ss << "null";
-                return ss.str() + ",\n";
-
-            case jsonxx::Value::BOOL_:
-                ss << ( t.bool_value_ ? "true" : "false" );
-                return ss.str() + ",\n";
-
-            case jsonxx::Value::ARRAY_:
-                ss << "[\n";
-                for(Array::container::const_iterator it = t.array_value_->values().begin(),
-                    end = t.array_value_->values().end(); it != end; ++it )
-                  ss << tag( format, depth+1, std::string(), **it );
-                return remove_last_comma( ss.str() ) + tab + "]" ",\n";
-
-            case jsonxx::Value::STRING_:
-                ss << '\"' << escape_string( *t.string_value_ ) << '\"';
-                return ss.str() + ",\n";
-
-            case jsonxx::Value::OBJECT_:
-                ss << "{\n";
-                for(Object::container::const_iterator it=t.object_value_->kv_map().begin(),
-                    end = t.object_value_->kv_map().end(); it != end ; ++it)
-                  ss << tag( format, depth+1, it->first, *it->second );
-                return remove_last_comma( ss.str() ) + tab + "}" ",\n";
-
-            case jsonxx::Value::NUMBER_:
-                // max precision
-                ss << std::setprecision(std::numeric_limits<long double>::digits10 + 1);
-                ss << t.number_value_;
-                return ss.str() + ",\n";
+// Deletes values without recursing: containers are emptied into the
+// worklist before they are deleted, so each destructor only sees leaves.
+// Containers still shared with copies just lose a reference.
+void release( std::vector<Value*> &pending ) {
+    while( !pending.empty() ) {
+        Value *v = pending.back();
+        pending.pop_back();
+        if( v->type_ == Value::ARRAY_ && v->array_value_ ) {
+            if( Array::container *elements = Internal::sole( *v->array_value_ ) ) {
+                pending.insert( pending.end(), elements->begin(), elements->end() );
+                elements->clear();
+            }
+        } else if( v->type_ == Value::OBJECT_ && v->object_value_ ) {
+            if( Object::container *members = Internal::sole( *v->object_value_ ) ) {
+                for( Object::container::iterator it = members->begin(); it != members->end(); ++it )
+                    pending.push_back( it->second );
+                members->clear();
+            }
         }
+        delete v;
     }
-} // namespace jsonxx::anon::json
+}
 
-namespace xml {
+void release( Object::container &members ) {
+    std::vector<Value*> pending;
+    pending.reserve( members.size() );
+    for( Object::container::iterator it = members.begin(); it != members.end(); ++it )
+        pending.push_back( it->second );
+    members.clear();
+    release( pending );
+}
 
-std::string escape_attrib( const std::string &input ) {
-    static std::string map[256], *once = 0;
-    if( !once ) {
-        for( int i = 0; i < 256; ++i )
-            map[ i ] = "_";
-        for( int i = int('a'); i <= int('z'); ++i )
-            map[ i ] = std::string() + char(i);
-        for( int i = int('A'); i <= int('Z'); ++i )
-            map[ i ] = std::string() + char(i);
-        for( int i = int('0'); i <= int('9'); ++i )
-            map[ i ] = std::string() + char(i);
-        once = map;
-    }
-    std::string output;
-    output.reserve( input.size() ); // worst scenario
-    for( std::string::const_iterator it = input.begin(), end = input.end(); it != end; ++it )
-        output += map[ byte(*it) ];
-    return output;
-}
-
-std::string escape_tag( const std::string &input, unsigned format ) {
-    static std::string map[256], *once = 0;
-    if( !once ) {
-        for( int i = 0; i < 256; ++i )
-            map[ i ] = std::string() + char(i);
-        map[ byte('<') ] = "&lt;";
-        map[ byte('>') ] = "&gt;";
-
-        switch( format )
-        {
-            default:
-                break;
+// Drops a reference to a body, taking it apart if it was the last one.
+template<typename Body>
+void drop( Body *body ) {
+    if( body && body->refs.fetch_sub( 1 ) == 1 ) {
+        release( body->values );
+        delete body;
+    }
+}
 
-            case jsonxx::JXML:
-            case jsonxx::JXMLex:
-            case jsonxx::JSONx:
-            case jsonxx::TaggedXML:
-                map[ byte('&') ] = "&amp;";
+// Copies values a level at a time. Arrays and objects share their values
+// with the copy where they can; where they cannot, the copy gets values of
+// its own, which are copied in turn off a worklist rather than the stack,
+// so copying containers leaked all the way down takes no recursion.
+class Copier {
+  public:
+    // Copies from into to, which must hold nothing to free. Values below
+    // it may be left for finish().
+    void copy( const Value &from, Value &to ) {
+        switch( from.type_ ) {
+            case Value::NUMBER_:
+                to.number_value_ = from.number_value_;
+                break;
+            case Value::BOOL_:
+                to.bool_value_ = from.bool_value_;
+                break;
+            case Value::STRING_:
+                to.string_value_ = new String( *from.string_value_ );
+                break;
+            case Value::ARRAY_:
+                to.array_value_ = new Array();
+                if( !Internal::adopt( *to.array_value_, *from.array_value_ ) )
+                    arrays.push_back( std::make_pair( from.array_value_, to.array_value_ ) );
+                break;
+            case Value::OBJECT_:
+                to.object_value_ = new Object();
+                if( !Internal::adopt( *to.object_value_, *from.object_value_ ) )
+                    objects.push_back( std::make_pair( from.object_value_, to.object_value_ ) );
+                break;
+            default:
                 break;
         }
-
-        once = map;
+        to.type_ = from.type_;
+    }
+    // Appends copies of from's values to to.
+    void copy( const Object::container &from, Object::container &to ) {
+        for( Object::container::const_iterator it = from.begin(); it != from.end(); ++it ) {
+            Value *value = new Value();
+            to.insert( to.end(), std::make_pair( it->first, value ) );
+            copy( *it->second, *value );
+        }
+    }
+    void copy( const Array::container &from, Array::container &to ) {
+        to.reserve( to.size() + from.size() );
+        for( Array::container::const_iterator it = from.begin(); it != from.end(); ++it ) {
+            Value *value = new Value();
+            to.push_back( value );
+            copy( **it, *value );
+        }
+    }
+    // Copies what copy() left, however deep.
+    void finish() {
+        while( !objects.empty() || !arrays.empty() ) {
+            if( !objects.empty() ) {
+                std::pair<const Object *, Object *> next = objects.back();
+                objects.pop_back();
+                copy( next.first->kv_map(), Internal::members( *next.second ) );
+            } else {
+                std::pair<const Array *, Array *> next = arrays.back();
+                arrays.pop_back();
+                copy( next.first->values(), Internal::elements( *next.second ) );
+            }
+        }
     }
-    std::string output;
-    output.reserve( input.size() * 5 ); // worst scenario
-    for( std::string::const_iterator it = input.begin(), end = input.end(); it != end; ++it )
-        output += map[ byte(*it) ];
-    return output;
+  private:
+    std::vector<std::pair<const Object *, Object *> > objects;
+    std::vector<std::pair<const Array *, Array *> > arrays;
+};
+
+void copy_node( const Value &from, Value &to ) {
+    to.reset();
+    Copier copier;
+    copier.copy( from, to );
+    copier.finish();
 }
 
-std::string open_tag( unsigned format, char type, const std::string &name, const std::string &attr = std::string(), const std::string &text = std::string() ) {
-    std::string tagname;
-    switch( format )
-    {
-        default:
-            return std::string();
+// A container seen through a const reference, as std::as_const: reading
+// its values then shares them rather than making them its own.
+template<typename T>
+const T &as_const( T &container ) {
+    return container;
+}
 
-        case jsonxx::JXML:
-            if( name.empty() )
-                tagname = std::string("j son=\"") + type + '\"';
-            else
-                tagname = std::string("j son=\"") + type + ':' + escape_string(name) + '\"';
-            break;
+// Moves from's contents into to, which must hold nothing to free.
+void take( Value &to, Value &from ) {
+    switch( from.type_ ) {
+        case Value::NUMBER_: to.number_value_ = from.number_value_; break;
+        case Value::BOOL_: to.bool_value_ = from.bool_value_; break;
+        case Value::STRING_: to.string_value_ = from.string_value_; break;
+        case Value::ARRAY_: to.array_value_ = from.array_value_; break;
+        case Value::OBJECT_: to.object_value_ = from.object_value_; break;
+        default: break;
+    }
+    to.type_ = from.type_;
+    from.type_ = Value::INVALID_;
+}
 
-        case jsonxx::JXMLex:
-            if( name.empty() )
-                tagname = std::string("j son=\"") + type + '\"';
-            else
-                tagname = std::string("j son=\"") + type + ':' + escape_string(name) + "\" " + escape_attrib(name) + "=\"" + escape_string(text) + "\"";
-            break;
+// What a walk came to: the value was read, the input is bad, or the
+// reader ran dry before either was clear (only a ChunkReader does).
+enum Step { FAILED, DONE, MORE };
+
+// The JSON grammar, without recursion. The walker reads one value and
+// reports it to a Handler as a sequence of events:
+//
+//   begin_object() key(text) ... end_object()
+//   begin_array() ... end_array()
+//   string(text) number(digits) boolean(b) null()
+//
+// Any event may return false to stop the walk. Handler::Text and
+// Handler::Digits receive the bytes of strings and numbers. The only state
+// the walker keeps is where it is in the grammar and one bit per open
+// container (object or array), so it can stop between any two tokens and
+// carry on later.
+template<typename P, typename Reader, typename Handler>
+class Walker {
+  public:
+    Walker( Reader &input, Handler &handler, const ParseOptions &options )
+        : in(input), out(handler), state(VALUE), depth(0), max_depth(options.max_depth),
+          utf8(options.utf8) {}
+
+    // Reads one value. Leading whitespace must have been skipped already;
+    // whatever follows the value is left unread.
+    bool run() {
+        return step() == DONE;
+    }
 
-        case jsonxx::JSONx:
-            if( !name.empty() )
-                tagname = std::string(" name=\"") + escape_string(name) + "\"";
-            switch( type ) {
-                default:
-                case '0': tagname = "json:null" + tagname; break;
-                case 'b': tagname = "json:boolean" + tagname; break;
-                case 'a': tagname = "json:array" + tagname; break;
-                case 's': tagname = "json:string" + tagname; break;
-                case 'o': tagname = "json:object" + tagname; break;
-                case 'n': tagname = "json:number" + tagname; break;
-            }
-            break;
+    // The same, for a reader that can starve: on MORE the reader is back at
+    // the start of the token it could not finish, and step() carries on
+    // from there once more input is in.
+    Step step() {
+        for(;;) {
+            const size_t mark = in.mark();
+            switch( state ) {
+                case VALUE: {
+                        const int kind = lead_of(in);
+                        if( kind == OB || kind == AR ) {
+                            in.skip();
+                            if( !push( kind == OB ) )
+                                return FAILED;
+                            if( !(kind == OB ? out.begin_object() : out.begin_array()) )
+                                return FAILED;
+                            state = OPEN;
+                        } else if( scalar(kind) ) {
+                            state = NEXT;
+                        } else {
+                            return stop( mark );
+                        }
+                    }
+                    break;
 
-        case jsonxx::TaggedXML: // @TheMadButcher
-            if( !name.empty() )
-                tagname = escape_attrib(name);
-            else
-                tagname = "JsonItem";
-            switch( type ) {
-                default:
-                case '0': tagname += " type=\"json:null\""; break;
-                case 'b': tagname += " type=\"json:boolean\""; break;
-                case 'a': tagname += " type=\"json:array\""; break;
-                case 's': tagname += " type=\"json:string\""; break;
-                case 'o': tagname += " type=\"json:object\""; break;
-                case 'n': tagname += " type=\"json:number\""; break;
-            }
+                case OPEN:
+                    if( !space() )
+                        return stop( mark );
+                    if( in.peek() == closer() ) {
+                        in.skip();
+                        if( !pop() )
+                            return FAILED;
+                        state = NEXT;
+                    } else {
+                        state = in_object() ? KEY : VALUE;
+                    }
+                    break;
 
-            if( !name.empty() )
-                tagname += std::string(" name=\"") + escape_string(name) + "\"";
+                case KEY:
+                    text.clear();
+                    if( !scan_key<P>(in, text) || !ready() || !checked(text) || !out.key(text) )
+                        return stop( mark );
+                    state = COLON;
+                    break;
 
-            break;
-    }
+                case COLON:
+                    if( !space() || in.peek() != ':' )
+                        return stop( mark );
+                    in.skip();
+                    if( !space() )
+                        return stop( mark );
+                    state = VALUE;
+                    break;
 
-    return std::string("<") + tagname + attr + ">";
-}
+                case NEXT:
+                    if( depth == 0 )
+                        return DONE;
+                    if( !space() )
+                        return stop( mark );
+                    if( in.peek() == ',' ) {
+                        in.skip();
+                        state = COMMA;
+                    } else if( in.peek() == closer() ) {
+                        in.skip();
+                        if( !pop() )
+                            return FAILED;
+                    } else {
+                        return FAILED;
+                    }
+                    break;
 
-std::string close_tag( unsigned format, char type, const std::string &name ) {
-    switch( format )
-    {
-        default:
-            return std::string();
-
-        case jsonxx::JXML:
-        case jsonxx::JXMLex:
-            return "</j>";
-
-        case jsonxx::JSONx:
-            switch( type ) {
-                default:
-                case '0': return "</json:null>";
-                case 'b': return "</json:boolean>";
-                case 'a': return "</json:array>";
-                case 'o': return "</json:object>";
-                case 's': return "</json:string>";
-                case 'n': return "</json:number>";
+                case COMMA:
+                    if( !space() )
+                        return stop( mark );
+                    if( P::permissive && in.peek() == closer() ) {
+                        in.skip();
+                        if( !pop() )
+                            return FAILED;
+                        state = NEXT;
+                    } else {
+                        state = in_object() ? KEY : VALUE;
+                    }
+                    break;
             }
-            break;
-
-        case jsonxx::TaggedXML: // @TheMadButcher
-            if( !name.empty() )
-                return "</"+escape_attrib(name)+">";
-            else
-                return "</JsonItem>";
+        }
     }
-}
 
-std::string tag( unsigned format, unsigned depth, const std::string &name, const jsonxx::Value &t, const std::string &attr = std::string() ) {
-    std::stringstream ss;
-    const std::string tab(depth, '\t');
+  private:
+    enum { InlineWords = 32, WordBits = sizeof(unsigned) * 8 };
+    enum State { VALUE, OPEN, KEY, COLON, NEXT, COMMA };
 
-    switch( t.type_ )
-    {
-        default:
-        case jsonxx::Value::NULL_:
-            return tab + open_tag( format, '0', name, " /" ) + '\n';
-
-        case jsonxx::Value::BOOL_:
-            ss << ( t.bool_value_ ? "true" : "false" );
-            return tab + open_tag( format, 'b', name, std::string(), format == jsonxx::JXMLex ? ss.str() : std::string() )
-                       + ss.str()
-                       + close_tag( format, 'b', name ) + '\n';
-
-        case jsonxx::Value::ARRAY_:
-            for(Array::container::const_iterator it = t.array_value_->values().begin(),
-                end = t.array_value_->values().end(); it != end; ++it )
-              ss << tag( format, depth+1, std::string(), **it );
-            return tab + open_tag( format, 'a', name, attr ) + '\n'
-                       + ss.str()
-                 + tab + close_tag( format, 'a', name ) + '\n';
-
-        case jsonxx::Value::STRING_:
-            ss << escape_tag( *t.string_value_, format );
-            return tab + open_tag( format, 's', name, std::string(), format == jsonxx::JXMLex ? ss.str() : std::string() )
-                       + ss.str()
-                       + close_tag( format, 's', name ) + '\n';
-
-        case jsonxx::Value::OBJECT_:
-            for(Object::container::const_iterator it=t.object_value_->kv_map().begin(),
-                end = t.object_value_->kv_map().end(); it != end ; ++it)
-              ss << tag( format, depth+1, it->first, *it->second );
-            return tab + open_tag( format, 'o', name, attr ) + '\n'
-                       + ss.str()
-                 + tab + close_tag( format, 'o', name ) + '\n';
-
-        case jsonxx::Value::NUMBER_:
-            // max precision
-            ss << std::setprecision(std::numeric_limits<long double>::digits10 + 1);
-            ss << t.number_value_;
-            return tab + open_tag( format, 'n', name, std::string(), format == jsonxx::JXMLex ? ss.str() : std::string() )
-                       + ss.str()
-                       + close_tag( format, 'n', name ) + '\n';
+    // Whether what was just read is whole: a starved reader may have cut
+    // a number or a bare key short.
+    bool ready() {
+        return !in.starved();
+    }
+    // Skips whitespace and comments up to a byte that is really there.
+    bool space() {
+        return skip_space<P>(in) && ready();
+    }
+    Step stop( size_t mark ) {
+        if( !in.starved() )
+            return FAILED;
+        in.rewind( mark );
+        return MORE;
     }
-}
-
-// order here matches jsonxx::Format enum
-const char *defheader[] = {
-    "",
-
-    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
-         JSONXX_XML_TAG "\n",
 
-    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
-         JSONXX_XML_TAG "\n",
+    bool scalar( int kind ) {
+        switch( kind ) {
+            case SQ:
+                if( !P::permissive )
+                    return false;
+                // fall through
+            case DQ:
+                text.clear();
+                return scan_string<P>(in, text) && ready() && checked(text) && out.string(text);
+            case NU:
+                digits.clear();
+                return scan_number(in, digits) && ready() && out.number(digits);
+            case TR:
+                return scan_literal(in, "true") && ready() && out.boolean(true);
+            case FA:
+                return scan_literal(in, "false") && ready() && out.boolean(false);
+            case NL:
+                return scan_literal(in, "null") && ready() && out.null();
+            case CM:
+                // permissive mode reads an omitted value as null: [1,,2]
+                return P::permissive && depth > 0 && out.null();
+            default:
+                return false;
+        }
+    }
 
-    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
-         JSONXX_XML_TAG "\n",
+    // Deep documents spill the container bits to the heap.
+    unsigned &word( size_t level ) {
+        const size_t index = level / WordBits;
+        if( index < InlineWords )
+            return bits[ index ];
+        if( index - InlineWords >= spill.size() )
+            spill.resize( index - InlineWords + 1 );
+        return spill[ index - InlineWords ];
+    }
+    template<typename Text>
+    bool checked( Text &t ) {
+        return !utf8 || is_utf8(t);
+    }
+    bool push( bool object ) {
+        if( depth >= max_depth )
+            return false;
+        const unsigned mask = 1u << (depth % WordBits);
+        unsigned &w = word( depth );
+        w = object ? (w | mask) : (w & ~mask);
+        ++depth;
+        return true;
+    }
+    bool pop() {
+        const bool object = in_object();
+        --depth;
+        return object ? out.end_object() : out.end_array();
+    }
+    bool in_object() {
+        return ( word( depth - 1 ) >> ((depth - 1) % WordBits) ) & 1u;
+    }
+    int closer() {
+        return in_object() ? '}' : ']';
+    }
 
-    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
-         JSONXX_XML_TAG "\n"
+    Reader &in;
+    Handler &out;
+    typename Handler::Text text;
+    typename Handler::Digits digits;
+    State state;
+    size_t depth, max_depth;
+    bool utf8;
+    unsigned bits[ InlineWords ];
+    std::vector<unsigned> spill;
 };
 
-// order here matches jsonxx::Format enum
-const char *defrootattrib[] = {
-    "",
+// The Stats a StatsScope opened on this thread, if any. busy is set while
+// a Probe counts a call, so the calls it makes are not counted again.
+struct Tally {
+    Stats *stats;
+    unsigned long long (*allocations)();
+    bool busy;
+};
 
-    " xsi:schemaLocation=\"http://www.datapower.com/schemas/json jsonx.xsd\""
-        " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
-        " xmlns:json=\"http://www.ibm.com/xmlns/prod/2009/jsonx\"",
+thread_local Tally tally = { 0, 0, false };
 
-    "",
+// Text that counts the escape sequences scan_string() decodes into it.
+template<typename Text>
+struct Counted : Text {
+    Counted() : stats( tally.stats ) {}
+    Stats *stats;
+};
 
-    "",
+template<typename Text>
+inline void note_escape( Counted<Text> &text ) {
+    ++text.stats->escapes_read;
+}
 
-    ""
+// Counts the values a Walker or an Emitter reports, and with an escape
+// table the bytes of their strings written escaped, before handing them
+// on to the handler behind it.
+template<typename Handler>
+class Census {
+  public:
+    typedef Counted<typename Handler::Text> Text;
+    typedef typename Handler::Digits Digits;
+
+    Census( Handler &handler, Stats &stats, const Escape *escapes = 0 )
+        : out(handler), stats(stats), escapes(escapes), depth(0) {}
+
+    bool null() { ++stats.nulls; return out.null(); }
+    bool boolean( bool b ) { ++stats.booleans; return out.boolean( b ); }
+    bool number( Number n ) { ++stats.numbers; return out.number( n ); }
+    template<typename Digits_>
+    bool number( Digits_ &digits ) { ++stats.numbers; return out.number( digits ); }
+    template<typename Text_>
+    bool string( Text_ &text ) { ++stats.strings; escaped( text ); return out.string( text ); }
+    template<typename Text_>
+    bool key( Text_ &text ) { ++stats.keys; escaped( text ); return out.key( text ); }
+    bool begin_object() { ++stats.objects; deeper(); return out.begin_object(); }
+    bool begin_array() { ++stats.arrays; deeper(); return out.begin_array(); }
+    bool end_object() { --depth; return out.end_object(); }
+    bool end_array() { --depth; return out.end_array(); }
+
+  private:
+    void deeper() {
+        if( ++depth > stats.max_depth )
+            stats.max_depth = depth;
+    }
+    void escaped( const std::string &text ) {
+        if( escapes )
+            for( size_t i = 0; i < text.size(); ++i )
+                stats.escapes_written += escapes[ static_cast<unsigned char>(text[i]) ].size != 0;
+    }
+    // validate() keeps no text
+    void escaped( const Discard & ) {}
+    void escaped( const Utf8Sink & ) {}
+
+    Handler &out;
+    Stats &stats;
+    const Escape *escapes;
+    size_t depth;
 };
 
-} // namespace jsonxx::anon::xml
+// Handler for a Census of a document that is already written.
+struct Ignore {
+    typedef Discard Text;
+    typedef Discard Digits;
+
+    bool null() { return true; }
+    bool boolean( bool ) { return true; }
+    bool number( Number ) { return true; }
+    bool string( const std::string & ) { return true; }
+    bool key( const std::string & ) { return true; }
+    bool begin_object() { return true; }
+    bool end_object() { return true; }
+    bool begin_array() { return true; }
+    bool end_array() { return true; }
+};
 
-} // namespace jsonxx::anon
+// Counts the values of a document written, below with the writers.
+template<typename Root>
+void count_document( const Root &root, Stats &stats, const Escape *escapes );
+
+// Counts one public call into the Stats open on this thread: its time, and
+// the allocations the scope's counter saw. Does nothing without a scope,
+// or inside a call already counted.
+class Probe {
+  public:
+    Probe() : stats(0) {
+        if( !tally.stats || tally.busy )
+            return;
+        stats = tally.stats;
+        tally.busy = true;
+        allocated = tally.allocations ? tally.allocations() : 0;
+        start = std::chrono::steady_clock::now();
+    }
+    ~Probe() {
+        stop();
+    }
 
-std::string Object::json() const {
-    using namespace json;
+    // Bytes count into the open Stats whichever Probe sees them.
+    static void read( size_t bytes ) {
+        if( tally.stats )
+            tally.stats->bytes_read += bytes;
+    }
+    static void wrote( size_t bytes ) {
+        if( tally.stats )
+            tally.stats->bytes_written += bytes;
+    }
+    // A document was written: counts its values once the clock stopped.
+    template<typename Root>
+    void wrote( const Root &root, size_t bytes, const Escape *escapes ) {
+        if( !stats )
+            return;
+        stats->bytes_written += bytes;
+        Stats &counted = *stats;
+        stop();
+        count_document( root, counted, escapes );
+    }
 
-    jsonxx::Value v;
-    v.object_value_ = const_cast<jsonxx::Object*>(this);
-    v.type_ = jsonxx::Value::OBJECT_;
+  private:
+    void stop() {
+        if( !stats )
+            return;
+        ++stats->calls;
+        stats->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start ).count();
+        if( tally.allocations )
+            stats->allocations += tally.allocations() - allocated;
+        tally.busy = false;
+        stats = 0;
+    }
 
-    std::string result = tag( jsonxx::JSON, 0, std::string(), v );
+    Stats *stats;
+    unsigned long long allocated;
+    std::chrono::steady_clock::time_point start;
+};
 
-    v.object_value_ = 0;
-    return remove_last_comma( result );
+// Walker( in, handler, options ).run(), counted when a StatsScope is open.
+// escapes is the table of the writer behind handler, if it writes.
+template<typename P, typename Reader, typename Handler>
+bool run_walker( Reader &in, Handler &handler, const ParseOptions &options, const Escape *escapes = 0 ) {
+    if( tally.stats ) {
+        Census<Handler> census( handler, *tally.stats, escapes );
+        return Walker<P, Reader, Census<Handler> >( in, census, options ).run();
+    }
+    return Walker<P, Reader, Handler>( in, handler, options ).run();
 }
 
-std::string Object::xml( unsigned format, const std::string &header, const std::string &attrib ) const {
-    using namespace xml;
-    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+// Walker handler that builds the document. Open containers are kept on a
+// heap stack, so nesting depth is bounded by ParseOptions::max_depth rather
+// than by the call stack.
+template<typename P>
+class Builder {
+  public:
+    typedef String Text;
+    typedef NumberText Digits;
+
+    explicit Builder( Value &root ) : value_root(&root), object_root(0), array_root(0) {
+        root.reset();
+        root.type_ = Value::INVALID_;
+    }
+    explicit Builder( Object &root ) : value_root(0), object_root(&root), array_root(0) {
+        root.reset();
+    }
+    explicit Builder( Array &root ) : value_root(0), object_root(0), array_root(&root) {
+        root.reset();
+    }
+
+    bool null() {
+        Value *v = slot();
+        if( !v ) return false;
+        v->type_ = Value::NULL_;
+        return true;
+    }
+    bool boolean( bool b ) {
+        Value *v = slot();
+        if( !v ) return false;
+        v->bool_value_ = b;
+        v->type_ = Value::BOOL_;
+        return true;
+    }
+    bool number( NumberText &digits ) {
+        Value *v = slot();
+        if( !v ) return false;
+        v->number_value_ = digits.value();
+        v->type_ = Value::NUMBER_;
+        return true;
+    }
+    bool string( String &text ) {
+        Value *v = slot();
+        if( !v ) return false;
+        v->string_value_ = new String();
+        v->string_value_->swap( text );
+        v->type_ = Value::STRING_;
+        return true;
+    }
+    bool key( String &text ) {
+        stack.back().key.swap( text );
+        return true;
+    }
+    bool begin_object() {
+        Object *object = object_root;
+        if( !stack.empty() || !object ) {
+            Value *v = slot();
+            if( !v ) return false;
+            v->object_value_ = object = new Object();
+            v->type_ = Value::OBJECT_;
+        }
+        stack.push_back( Frame( object, 0 ) );
+        return true;
+    }
+    bool begin_array() {
+        Array *array = array_root;
+        if( !stack.empty() || !array ) {
+            Value *v = slot();
+            if( !v ) return false;
+            v->array_value_ = array = new Array();
+            v->type_ = Value::ARRAY_;
+        }
+        stack.push_back( Frame( 0, array ) );
+        return true;
+    }
+    bool end_object() {
+        stack.pop_back();
+        return true;
+    }
+    bool end_array() {
+        stack.pop_back();
+        return true;
+    }
 
-    jsonxx::Value v;
-    v.object_value_ = const_cast<jsonxx::Object*>(this);
-    v.type_ = jsonxx::Value::OBJECT_;
+  private:
+    struct Frame {
+        Frame( Object *o, Array *a ) : object(o), array(a) {}
+        Object *object;
+        Array *array;
+        std::string key;  // of the next member, if an object
+    };
+
+    // Where the next value goes: the root, the end of the open array, or
+    // the pending key of the open object.
+    Value *slot() {
+        if( stack.empty() )
+            return value_root;
+        Frame &top = stack.back();
+        Value *v = new Value();
+        if( top.array ) {
+            Internal::elements( *top.array ).push_back( v );
+            return v;
+        }
+        // TODO(hjiang): Add an option to allow duplicated keys?
+        Object::container &members = Internal::members( *top.object );
+        std::pair<Object::container::iterator, bool> slot = members.insert( std::make_pair( std::move(top.key), v ) );
+        if( !slot.second ) {
+            if( !P::permissive ) {
+                delete v;
+                return 0;
+            }
+            delete slot.first->second;
+            slot.first->second = v;
+        }
+        return v;
+    }
 
-    std::string result = tag( format, 0, std::string(), v, attrib.empty() ? std::string(defrootattrib[format]) : attrib );
+    Value *value_root;
+    Object *object_root;
+    Array *array_root;
+    std::vector<Frame> stack;
+};
 
-    v.object_value_ = 0;
-    return ( header.empty() ? std::string(defheader[format]) : header ) + result;
+template<typename P, typename Reader>
+bool read_document( Reader &in, Value &value, const ParseOptions &options ) {
+    Builder<P> builder( value );
+    return skip_space<P>(in) && run_walker<P>( in, builder, options );
 }
 
-std::string Array::json() const {
-    using namespace json;
+template<typename P, typename Reader>
+bool read_document( Reader &in, Object &object, const ParseOptions &options ) {
+    Builder<P> builder( object );
+    return skip_space<P>(in) && in.peek() == '{' && run_walker<P>( in, builder, options );
+}
 
-    jsonxx::Value v;
-    v.array_value_ = const_cast<jsonxx::Array*>(this);
-    v.type_ = jsonxx::Value::ARRAY_;
+template<typename P, typename Reader>
+bool read_document( Reader &in, Array &array, const ParseOptions &options ) {
+    Builder<P> builder( array );
+    return skip_space<P>(in) && in.peek() == '[' && run_walker<P>( in, builder, options );
+}
 
-    std::string result = tag( jsonxx::JSON, 0, std::string(), v );
+template<typename Reader, typename Target>
+class ReadTask {
+  public:
+    ReadTask( Reader &input, Target &target, const ParseOptions &options )
+        : in(input), target(target), options(options) {}
+    template<typename P> bool run() { return read_document<P>(in, target, options); }
+  private:
+    Reader &in;
+    Target &target;
+    const ParseOptions &options;
+};
 
-    v.array_value_ = 0;
-    return remove_last_comma( result );
+template<typename Reader, typename Target>
+bool read_document( Reader &in, Target &target, const ParseOptions &options ) {
+    Probe probe;
+    ReadTask<Reader, Target> task( in, target, options );
+    const bool read = dispatch( options, task );
+    Probe::read( in.offset() );
+    return read;
 }
 
-std::string Array::xml( unsigned format, const std::string &header, const std::string &attrib ) const {
-    using namespace xml;
-    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+} // namespace jsonxx::anon
 
-    jsonxx::Value v;
-    v.array_value_ = const_cast<jsonxx::Array*>(this);
-    v.type_ = jsonxx::Value::ARRAY_;
+struct PushParser::State {
+    State() : step( MORE ) {}
+    virtual ~State() {}
+    // Reads a piece, last being the end of the input.
+    virtual Step feed( const char *data, size_t size, bool last ) = 0;
+    Step step;
+};
 
-    std::string result = tag( format, 0, std::string(), v, attrib.empty() ? std::string(defrootattrib[format]) : attrib );
+namespace {
 
-    v.array_value_ = 0;
-    return ( header.empty() ? std::string(defheader[format]) : header ) + result;
-}
+// The byte a document for the target must open with, if any.
+inline int opener( const Value & ) { return 0; }
+inline int opener( const Object & ) { return '{'; }
+inline int opener( const Array & ) { return '['; }
+
+template<typename P, typename Target>
+class PushState : public PushParser::State {
+  public:
+    PushState( Target &target, const ParseOptions &options )
+        : builder( target ), walker( in, builder, options ), first( opener(target) ),
+          started( false ), tried( 0 ) {}
+
+    Step feed( const char *data, size_t size, bool last ) {
+        if( step != MORE )
+            return step;
+        const char *text = data;
+        size_t length = size;
+        if( !carry.empty() ) {
+            carry.append( data, size );
+            // a long token is read again only once the input behind it has
+            // doubled, so rereading stays linear
+            if( !last && tried > 256 && carry.size() < 2 * tried )
+                return MORE;
+            text = carry.data();
+            length = carry.size();
+        }
+        in.reset( text, length, last );
+        step = walk();
+        if( step == MORE ) {
+            const size_t used = in.offset();
+            if( carry.empty() )
+                carry.assign( text + used, length - used );
+            else
+                carry.erase( 0, used );
+            tried = carry.size();
+        } else {
+            std::string().swap( carry );
+        }
+        return step;
+    }
 
-bool validate( std::istream &input ) {
+  private:
+    Step walk() {
+        if( !started ) {
+            const size_t mark = in.mark();
+            if( !skip_space<P>(in) || in.peek() < 0 || (first && in.peek() != first) ) {
+                if( !in.starved() )
+                    return FAILED;
+                in.rewind( mark );
+                return MORE;
+            }
+            started = true;
+        }
+        return walker.step();
+    }
 
-    // trim non-printable chars
-    for( char ch(0); !input.eof() && input.peek() <= 32; )
-        input.get(ch);
+    ChunkReader in;
+    Builder<P> builder;
+    Walker<P, ChunkReader, Builder<P> > walker;
+    const int first;
+    bool started;
+    std::string carry;  // the unfinished token
+    size_t tried;       // carry size when it was last read
+};
 
-    // validate json
-    if( input.peek() == '{' )
-    {
-        jsonxx::Object o;
-        if( parse_object( input, o ) )
-            return true;
-    }
-    else
-    if( input.peek() == '[' )
-    {
-        jsonxx::Array a;
-        if( parse_array( input, a ) )
-            return true;
+template<typename Target>
+class PushTask {
+  public:
+    PushTask( Target &target, const ParseOptions &options )
+        : state(0), target(target), options(options) {}
+    template<typename P> bool run() {
+        state = new PushState<P, Target>( target, options );
+        return true;
     }
+    PushParser::State *state;
+  private:
+    Target &target;
+    const ParseOptions &options;
+};
 
-    // bad json input
-    return false;
+template<typename Target>
+PushParser::State *push_state( Target &target, const ParseOptions &options ) {
+    PushTask<Target> task( target, options );
+    dispatch( options, task );
+    return task.state;
 }
 
-bool validate( const std::string &input ) {
-    std::istringstream is( input );
-    return jsonxx::validate( is );
-}
+// Parallel parsing of a large top-level array. A quick scan that only
+// follows strings, comments and brackets finds top-level commas to cut
+// at; each piece is then parsed on its own into an array of its own.
+// Anything unusual (omitted values, trailing commas, bad input) makes
+// the speculation fail, and the caller parses serially instead, which
+// also gives the right answer for bad input.
+
+// The offsets of the opening bracket, of `parts - 1` top-level commas
+// spread evenly over the input, and of the closing bracket.
+template<typename P>
+bool split_array( const char *data, size_t size, size_t parts, std::vector<size_t> &cuts ) {
+    BufferReader in( data, size );
+    if( !skip_space<P>(in) || in.peek() != '[' )
+        return false;
+    size_t i = in.offset(), depth = 0;
+    cuts.push_back( i );
+    for( ; i < size; ++i ) {
+        switch( data[i] ) {
+            case '"':
+                for( ++i;; ) {
+                    if( i < size )
+                        i += json_clean_run( data + i, size - i );
+                    if( i >= size )
+                        return false;
+                    if( data[i] == '"' )
+                        break;
+                    i += data[i] == '\\' ? 2 : 1;
+                }
+                break;
+            case '\'':
+                if( !P::permissive )
+                    return false;
+                for( ++i; i < size && data[i] != '\'';  )
+                    i += data[i] == '\\' ? 2 : 1;
+                if( i >= size )
+                    return false;
+                break;
+            case '/':
+                if( P::comments && i + 1 < size && data[i + 1] == '/' )
+                    while( i < size && data[i] != '\n' )
+                        ++i;
+                break;
+            case '[':
+            case '{':
+                ++depth;
+                break;
+            case ']':
+            case '}':
+                // the pieces check their own brackets, not the outer ones
+                if( --depth == 0 ) {
+                    cuts.push_back( i );
+                    return data[i] == ']' && cuts.size() > 2;
+                }
+                break;
+            case ',':
+                if( depth == 1 && i - cuts[0] >= (size - cuts[0]) / parts * (cuts.size()) )
+                    cuts.push_back( i );
+                break;
+        }
+    }
+    return false;
+}
+
+// Elements separated by commas, between two cuts.
+template<typename P>
+bool parse_elements( const char *data, size_t size, Array &array, const ParseOptions &options ) {
+    ParseOptions inner( options );
+    inner.max_depth = options.max_depth - 1;  // below the outer array
+    Builder<P> builder( array );
+    builder.begin_array();
+    BufferReader in( data, size );
+    for(;;) {
+        if( !skip_space<P>(in) || !run_walker<P>( in, builder, inner ) )
+            return false;
+        if( !skip_space<P>(in) )
+            return false;
+        if( in.peek() < 0 )
+            break;
+        if( in.peek() != ',' )
+            return false;
+        in.skip();
+    }
+    return builder.end_array();
+}
+
+// Adds the values counted in from, found depth levels down, to to.
+void add( Stats &to, const Stats &from, size_t depth ) {
+    to.objects += from.objects;
+    to.arrays += from.arrays;
+    to.strings += from.strings;
+    to.numbers += from.numbers;
+    to.booleans += from.booleans;
+    to.nulls += from.nulls;
+    to.keys += from.keys;
+    to.escapes_read += from.escapes_read;
+    to.max_depth = std::max( to.max_depth, std::max<size_t>( from.max_depth + depth, depth ) );
+}
+
+class ParallelArrayTask {
+  public:
+    ParallelArrayTask( const std::string &input, Array &target, const ParseOptions &options )
+        : input(input), target(target), options(options) {}
+
+    template<typename P> bool run() {
+        const unsigned threads = thread_count( options.threads );
+        std::vector<size_t> cuts;
+        if( threads < 2 || options.max_depth < 1 ||
+            !split_array<P>( input.data(), input.size(), threads * 4, cuts ) )
+            return false;
+
+        const size_t n = cuts.size() - 1;
+        std::vector<Array> parts( n );
+        std::vector<char> parsed( n, 0 );
+        // each piece counts into Stats of its own, added up below
+        Stats *const stats = tally.stats;
+        std::vector<Stats> counts( stats ? n : 0 );
+        run_parallel( threads, n, [&]( size_t i ) {
+            const size_t begin = cuts[i] + 1;
+            if( stats ) {
+                StatsScope scope( counts[i] );
+                parsed[i] = parse_elements<P>( input.data() + begin, cuts[i + 1] - begin, parts[i], options );
+            } else {
+                parsed[i] = parse_elements<P>( input.data() + begin, cuts[i + 1] - begin, parts[i], options );
+            }
+        } );
+        for( size_t i = 0; i < n; ++i )
+            if( !parsed[i] )
+                return false;
+        if( stats ) {
+            ++stats->arrays;
+            for( size_t i = 0; i < n; ++i )
+                add( *stats, counts[i], 1 );
+        }
+
+        target.reset();
+        Array::container &all = Internal::elements( target );
+        size_t total = 0;
+        for( size_t i = 0; i < n; ++i )
+            total += parts[i].size();
+        all.reserve( total );
+        for( size_t i = 0; i < n; ++i ) {
+            Array::container &elements = Internal::elements( parts[i] );
+            all.insert( all.end(), elements.begin(), elements.end() );
+            elements.clear();
+        }
+        return true;
+    }
+
+  private:
+    const std::string &input;
+    Array &target;
+    const ParseOptions &options;
+};
+
+} // namespace jsonxx::anon
+
+
+Object::Object() : body_(0), value_map_(none()) {}
+
+const Object::container *Object::none() {
+    static const container empty;
+    return &empty;
+}
+
+Object::~Object() {
+    reset();
+}
+
+bool Object::parse(std::istream& input, Object& object) {
+    StreamReader in( input );
+    return read_document( in, object, ParseOptions() );
+}
+
+Value::Value() : type_(INVALID_) {}
+
+void Value::reset() {
+    if (type_ == STRING_) {
+        delete string_value_;
+        string_value_ = 0;
+    }
+    else if (type_ == OBJECT_) {
+        delete object_value_;
+        object_value_ = 0;
+    }
+    else if (type_ == ARRAY_) {
+        delete array_value_;
+        array_value_ = 0;
+    }
+}
+
+bool Value::parse(std::istream& input, Value& value) {
+    StreamReader in( input );
+    return read_document( in, value, ParseOptions() );
+}
+
+Array::Array() : body_(0), values_(none()) {}
+
+const Array::container *Array::none() {
+    static const container empty;
+    return &empty;
+}
+
+Array::~Array() {
+    reset();
+}
+
+bool Array::parse(std::istream& input, Array& array) {
+    StreamReader in( input );
+    return read_document( in, array, ParseOptions() );
+}
+
+static std::ostream& stream_string(std::ostream& stream,
+                                   const std::string& string) {
+    StreamSink out(stream);
+    out.put('"');
+    escape_json(out, string);
+    out.put('"');
+    return stream;
+}
+
+}  // namespace jsonxx
+
+std::ostream& operator<<(std::ostream& stream, const jsonxx::Value& v) {
+    using namespace jsonxx;
+    if (v.is<Number>()) {
+        return stream << v.get<Number>();
+    } else if (v.is<String>()) {
+        return stream_string(stream, v.get<std::string>());
+    } else if (v.is<Boolean>()) {
+        if (v.get<Boolean>()) {
+            return stream << "true";
+        } else {
+            return stream << "false";
+        }
+    } else if (v.is<Null>()) {
+        return stream << "null";
+    } else if (v.is<Object>()) {
+        return stream << v.get<Object>();
+    } else if (v.is<Array>()){
+        return stream << v.get<Array>();
+    }
+    // Shouldn't reach here.
+    return stream;
+}
+
+std::ostream& operator<<(std::ostream& stream, const jsonxx::Array& v) {
+    stream << "[";
+    jsonxx::Array::container::const_iterator
+        it = v.values().begin(),
+        end = v.values().end();
+    while (it != end) {
+        stream << *(*it);
+        ++it;
+        if (it != end) {
+            stream << ", ";
+        }
+    }
+    return stream << "]";
+}
+
+std::ostream& operator<<(std::ostream& stream, const jsonxx::Object& v) {
+    stream << "{";
+    jsonxx::Object::container::const_iterator
+        it = v.kv_map().begin(),
+        end = v.kv_map().end();
+    while (it != end) {
+        jsonxx::stream_string(stream, it->first);
+        stream << ": " << *(it->second);
+        ++it;
+        if (it != end) {
+            stream << ", ";
+        }
+    }
+    return stream << "}";
+}
+
+
+namespace jsonxx {
+namespace {
+
+typedef unsigned char byte;
+
+// Writes n as the ostream inserters do with the precision jsonxx has
+// always used, but with a '.' whatever the C locale. Returns the length.
+size_t format_number( Number n, char (&text)[64] ) {
+    const int size = snprintf( text, sizeof(text), "%.*Lg",
+                               std::numeric_limits<long double>::digits10 + 1, n );
+    const char point = *localeconv()->decimal_point;
+    if( point != '.' )
+        for( int i = 0; i < size; ++i )
+            if( text[i] == point )
+                text[i] = '.';
+    return size_t( size );
+}
+
+// Replays a document as the events a Walker reports while reading its
+// text, so a writer serves parsed input and documents alike. Iterative,
+// like release().
+template<typename Handler>
+class Emitter {
+  public:
+    explicit Emitter( Handler &handler ) : out(handler) {}
+
+    bool run( const Value &root ) { return value( root ) && drain(); }
+    bool run( const Object &root ) { return open( root ) && drain(); }
+    bool run( const Array &root ) { return open( root ) && drain(); }
+
+  private:
+    struct Frame {
+        const Object::container *members;
+        Object::container::const_iterator member;
+        const Array::container *elements;
+        Array::container::const_iterator element;
+    };
+
+    bool open( const Object &object ) {
+        Frame f;
+        f.members = &object.kv_map();
+        f.member = f.members->begin();
+        f.elements = 0;
+        stack.push_back( f );
+        return out.begin_object();
+    }
+    bool open( const Array &array ) {
+        Frame f;
+        f.members = 0;
+        f.elements = &array.values();
+        f.element = f.elements->begin();
+        stack.push_back( f );
+        return out.begin_array();
+    }
+    bool value( const Value &v ) {
+        switch( v.type_ ) {
+            case Value::OBJECT_: return open( *v.object_value_ );
+            case Value::ARRAY_:  return open( *v.array_value_ );
+            case Value::STRING_: return out.string( *v.string_value_ );
+            case Value::NUMBER_: return out.number( v.number_value_ );
+            case Value::BOOL_:   return out.boolean( v.bool_value_ );
+            default:             return out.null();
+        }
+    }
+    bool drain() {
+        while( !stack.empty() ) {
+            Frame &f = stack.back();
+            if( f.members ) {
+                if( f.member == f.members->end() ) {
+                    stack.pop_back();
+                    if( !out.end_object() )
+                        return false;
+                    continue;
+                }
+                const Object::container::value_type &member = *f.member++;
+                if( !out.key( member.first ) || !value( *member.second ) )
+                    return false;
+            } else {
+                if( f.element == f.elements->end() ) {
+                    stack.pop_back();
+                    if( !out.end_array() )
+                        return false;
+                    continue;
+                }
+                if( !value( **f.element++ ) )
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    Handler &out;
+    std::vector<Frame> stack;
+};
+
+template<typename Root>
+void count_document( const Root &root, Stats &stats, const Escape *escapes ) {
+    Ignore ignore;
+    Census<Ignore> census( ignore, stats, escapes );
+    Emitter< Census<Ignore> >( census ).run( root );
+}
+
+namespace json {
+
+// Writes JSON straight into a sink as a document is walked (by a Walker or
+// an Emitter), in the layout json() has always used or compact. Separators
+// are written when the next value or the closing bracket shows up, so the
+// only state is the nesting depth.
+template<typename Sink>
+class Writer {
+  public:
+    typedef String Text;
+    typedef NumberText Digits;
+
+    Writer( Sink &output, bool compact, size_t depth = 0 )
+        : out(output), compact(compact), depth(depth), pending(false), keyed(false) {}
+
+    bool null() {
+        return scalar( "null", 4 );
+    }
+    bool boolean( bool b ) {
+        return b ? scalar( "true", 4 ) : scalar( "false", 5 );
+    }
+    bool number( NumberText &digits ) {
+        return number( digits.value() );
+    }
+    bool number( Number n ) {
+        char text[64];
+        return scalar( text, format_number( n, text ) );
+    }
+    bool string( const String &text ) {
+        begin_value();
+        out.put( '"' );
+        escape_json( out, text );
+        out.put( '"' );
+        pending = true;
+        return true;
+    }
+    bool key( const String &text ) {
+        separate();
+        out.put( '"' );
+        escape_json( out, text );
+        if( compact )
+            out.write( "\":", 2 );
+        else
+            out.write( "\": ", 3 );
+        keyed = true;
+        return true;
+    }
+    bool begin_object() { return open( '{' ); }
+    bool begin_array() { return open( '[' ); }
+    bool end_object() { return close( '}' ); }
+    bool end_array() { return close( ']' ); }
+
+    // Appends members or elements written by another Writer of the same
+    // layout and depth.
+    void splice( const std::string &values ) {
+        if( values.empty() )
+            return;
+        if( pending )
+            out.write( compact ? "," : ",\n", compact ? 1 : 2 );
+        out.write( values.data(), values.size() );
+        pending = true;
+    }
+
+    // Ends the document.
+    void finish() {
+        if( pending && !compact )
+            out.write( " \n", 2 );
+        pending = false;
+    }
+
+  private:
+    void separate() {
+        if( compact ) {
+            if( pending )
+                out.put( ',' );
+        } else {
+            if( pending )
+                out.write( ",\n", 2 );
+            indent();
+        }
+        pending = false;
+    }
+    void begin_value() {
+        if( !keyed )
+            separate();
+        keyed = false;
+    }
+    void indent() {
+        static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+        for( size_t n = depth; n; ) {
+            const size_t run = n < 16 ? n : 16;
+            out.write( tabs, run );
+            n -= run;
+        }
+    }
+    bool scalar( const char *text, size_t size ) {
+        begin_value();
+        out.write( text, size );
+        pending = true;
+        return true;
+    }
+    bool open( char bracket ) {
+        begin_value();
+        out.put( bracket );
+        if( !compact )
+            out.put( '\n' );
+        ++depth;
+        return true;
+    }
+    bool close( char bracket ) {
+        --depth;
+        if( !compact ) {
+            // the last member gets a space where its comma would be
+            if( pending )
+                out.write( " \n", 2 );
+            indent();
+        }
+        out.put( bracket );
+        pending = true;
+        return true;
+    }
+
+    Sink &out;
+    const bool compact;
+    size_t depth;
+    bool pending;  // a value was written and still needs its separator
+    bool keyed;    // a key was written and the value goes on its line
+};
+
+template<typename Sink, typename Root>
+void write_document( Sink &out, const Root &root, bool compact ) {
+    Writer<Sink> writer( out, compact );
+    Emitter< Writer<Sink> >( writer ).run( root );
+    writer.finish();
+}
+
+// Writes like write_document(), but the members of arrays and objects
+// with at least min_parallel of them are split into chunks that worker
+// threads write into separate buffers, spliced back in order. Everything
+// else is written on the calling thread as it walks down to them, at any
+// depth and without recursion.
+template<typename Sink>
+class ParallelWriter {
+  public:
+    ParallelWriter( Sink &output, const WriteOptions &options )
+        : out(output, options.compact), compact(options.compact),
+          threads(thread_count(options.threads)),
+          min_parallel(options.min_parallel > 64 ? options.min_parallel : 64), depth(0) {}
+
+    template<typename Root>
+    void run( const Root &root ) {
+        if( threads > 1 ) {
+            open( root );
+            drain();
+        } else {
+            Emitter< Writer<Sink> >( out ).run( root );
+        }
+        out.finish();
+    }
+
+  private:
+    struct Frame {
+        const Object::container *members;
+        Object::container::const_iterator member;
+        const Array::container *elements;
+        Array::container::const_iterator element;
+    };
+
+    void value( const Value &v ) {
+        switch( v.type_ ) {
+            case Value::OBJECT_: open( *v.object_value_ ); break;
+            case Value::ARRAY_:  open( *v.array_value_ ); break;
+            case Value::STRING_: out.string( *v.string_value_ ); break;
+            case Value::NUMBER_: out.number( v.number_value_ ); break;
+            case Value::BOOL_:   out.boolean( v.bool_value_ ); break;
+            default:             out.null(); break;
+        }
+    }
+
+    // Large containers are written whole, in chunks; small ones are put on
+    // the stack to be walked.
+    void open( const Array &array ) {
+        const Array::container &elements = array.values();
+        out.begin_array();
+        ++depth;
+        if( elements.size() >= min_parallel ) {
+            std::vector<Array::container::const_iterator> bounds;
+            for( size_t i = 0, n = chunks( elements.size() ); i <= n; ++i )
+                bounds.push_back( elements.begin() + elements.size() * i / n );
+            write_chunks( bounds );
+            --depth;
+            out.end_array();
+            return;
+        }
+        Frame f;
+        f.members = 0;
+        f.elements = &elements;
+        f.element = elements.begin();
+        stack.push_back( f );
+    }
+    void open( const Object &object ) {
+        const Object::container &members = object.kv_map();
+        out.begin_object();
+        ++depth;
+        if( members.size() >= min_parallel ) {
+            // maps have no random access, so find the chunk bounds in one pass
+            const size_t n = chunks( members.size() );
+            std::vector<Object::container::const_iterator> bounds;
+            Object::container::const_iterator it = members.begin();
+            for( size_t i = 0, at = 0; i <= n; ++i ) {
+                for( const size_t next = members.size() * i / n; at < next; ++at )
+                    ++it;
+                bounds.push_back( it );
+            }
+            write_chunks( bounds );
+            --depth;
+            out.end_object();
+            return;
+        }
+        Frame f;
+        f.members = &members;
+        f.member = members.begin();
+        f.elements = 0;
+        stack.push_back( f );
+    }
+    void drain() {
+        while( !stack.empty() ) {
+            Frame &f = stack.back();
+            if( f.members ) {
+                if( f.member == f.members->end() ) {
+                    stack.pop_back();
+                    --depth;
+                    out.end_object();
+                    continue;
+                }
+                const Object::container::value_type &member = *f.member++;
+                out.key( member.first );
+                value( *member.second );
+            } else {
+                if( f.element == f.elements->end() ) {
+                    stack.pop_back();
+                    --depth;
+                    out.end_array();
+                    continue;
+                }
+                value( **f.element++ );
+            }
+        }
+    }
+
+    // A few chunks per thread, so uneven ones even out.
+    size_t chunks( size_t size ) const {
+        const size_t n = size_t( threads ) * 4, most = size / (min_parallel / 16 + 1) + 1;
+        return n < most ? n : most;
+    }
+
+    static void write_range( Writer<StringSink> &writer, Array::container::const_iterator begin,
+                             Array::container::const_iterator end ) {
+        Emitter< Writer<StringSink> > emitter( writer );
+        for( ; begin != end; ++begin )
+            emitter.run( **begin );
+    }
+    static void write_range( Writer<StringSink> &writer, Object::container::const_iterator begin,
+                             Object::container::const_iterator end ) {
+        Emitter< Writer<StringSink> > emitter( writer );
+        for( ; begin != end; ++begin ) {
+            writer.key( begin->first );
+            emitter.run( *begin->second );
+        }
+    }
+
+    template<typename Iterator>
+    void write_chunks( const std::vector<Iterator> &bounds ) {
+        const size_t n = bounds.size() - 1;
+        std::vector<std::string> buffers( n );
+        const bool compact = this->compact;
+        const size_t depth = this->depth;
+        run_parallel( threads, n, [&]( size_t i ) {
+            StringSink sink( buffers[i] );
+            Writer<StringSink> writer( sink, compact, depth );
+            write_range( writer, bounds[i], bounds[i + 1] );
+        } );
+
+        for( size_t i = 0; i < n; ++i ) {
+            out.splice( buffers[i] );
+            std::string().swap( buffers[i] );
+        }
+    }
+
+    Writer<Sink> out;
+    const bool compact;
+    const unsigned threads;
+    const size_t min_parallel;
+    size_t depth;
+    std::vector<Frame> stack;
+};
+
+} // namespace jsonxx::anon::json
+
+namespace xml {
+
+// Writes a document in one of the XML formats straight into a sink as it
+// is walked (by a Walker or an Emitter). The only state is the names of
+// the open containers, which TaggedXML closing tags repeat.
+template<typename Sink>
+class Writer {
+  public:
+    typedef String Text;
+    typedef NumberText Digits;
+
+    Writer( Sink &output, unsigned format, const std::string &root_attrib )
+        : out(output), format(format), root_attrib(root_attrib) {}
+
+    bool null() {
+        indent();
+        open_tag( '0', " /", 0, 0 );
+        out.put( '\n' );
+        name.clear();
+        return true;
+    }
+    bool boolean( bool b ) {
+        return b ? scalar( 'b', "true", 4 ) : scalar( 'b', "false", 5 );
+    }
+    bool number( NumberText &digits ) {
+        return number( digits.value() );
+    }
+    bool number( Number n ) {
+        char text[64];
+        return scalar( 'n', text, format_number( n, text ) );
+    }
+    bool string( const String &text ) {
+        if( format == jsonxx::JXMLex ) {
+            // the escaped text goes in an attribute too
+            scratch.clear();
+            StringSink sink( scratch );
+            escape_xml( sink, text, format );
+            return scalar( 's', scratch.data(), scratch.size() );
+        }
+        indent();
+        open_tag( 's', 0, 0, 0 );
+        escape_xml( out, text, format );
+        close_tag( 's', name );
+        out.put( '\n' );
+        name.clear();
+        return true;
+    }
+    bool key( const String &text ) {
+        name = text;
+        return true;
+    }
+    bool key( String &text ) {
+        name.swap( text );
+        return true;
+    }
+    bool begin_object() { return open( 'o' ); }
+    bool begin_array() { return open( 'a' ); }
+    bool end_object() { return close( 'o' ); }
+    bool end_array() { return close( 'a' ); }
+
+  private:
+    static const char *type_name( char type ) {
+        switch( type ) {
+            default:
+            case '0': return "null";
+            case 'b': return "boolean";
+            case 'a': return "array";
+            case 's': return "string";
+            case 'o': return "object";
+            case 'n': return "number";
+        }
+    }
+
+    void text( const char *data ) {
+        out.write( data, std::strlen(data) );
+    }
+    void indent() {
+        static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+        for( size_t n = names.size(); n; ) {
+            const size_t run = n < 16 ? n : 16;
+            out.write( tabs, run );
+            n -= run;
+        }
+    }
+    // Element and attribute names keep [A-Za-z0-9]; the rest become '_'.
+    void element_name( const std::string &key ) {
+        if( key.empty() ) {
+            text( "JsonItem" );
+            return;
+        }
+        char chunk[64];
+        for( size_t i = 0; i < key.size(); ) {
+            size_t n = 0;
+            for( ; n < sizeof(chunk) && i < key.size(); ++n, ++i )
+                chunk[n] = xml_name_chars[ byte(key[i]) ];
+            out.write( chunk, n );
+        }
+    }
+
+    // JXMLex repeats the value in the opening tag; containers and null
+    // repeat nothing.
+    void open_tag( char type, const char *attr, const char *value, size_t size ) {
+        out.put( '<' );
+        switch( format ) {
+            case jsonxx::JXML:
+            case jsonxx::JXMLex:
+                text( "j son=\"" );
+                out.put( type );
+                if( !name.empty() ) {
+                    out.put( ':' );
+                    escape_json( out, name );
+                    if( format == jsonxx::JXMLex ) {
+                        text( "\" " );
+                        element_name( name );
+                        text( "=\"" );
+                        escape_json( out, value, size );
+                    }
+                }
+                out.put( '"' );
+                break;
+
+            case jsonxx::JSONx:
+                text( "json:" );
+                text( type_name(type) );
+                if( !name.empty() ) {
+                    text( " name=\"" );
+                    escape_json( out, name );
+                    out.put( '"' );
+                }
+                break;
+
+            case jsonxx::TaggedXML: // @TheMadButcher
+                element_name( name );
+                text( " type=\"json:" );
+                text( type_name(type) );
+                out.put( '"' );
+                if( !name.empty() ) {
+                    text( " name=\"" );
+                    escape_json( out, name );
+                    out.put( '"' );
+                }
+                break;
+        }
+        if( attr )
+            text( attr );
+        out.put( '>' );
+    }
+    void close_tag( char type, const std::string &key ) {
+        switch( format ) {
+            case jsonxx::JXML:
+            case jsonxx::JXMLex:
+                text( "</j>" );
+                break;
+
+            case jsonxx::JSONx:
+                text( "</json:" );
+                text( type_name(type) );
+                out.put( '>' );
+                break;
+
+            case jsonxx::TaggedXML:
+                text( "</" );
+                element_name( key );
+                out.put( '>' );
+                break;
+        }
+    }
+
+    bool scalar( char type, const char *value, size_t size ) {
+        indent();
+        open_tag( type, 0, value, size );
+        out.write( value, size );
+        close_tag( type, name );
+        out.put( '\n' );
+        name.clear();
+        return true;
+    }
+    bool open( char type ) {
+        indent();
+        open_tag( type, names.empty() ? root_attrib.c_str() : 0, 0, 0 );
+        out.put( '\n' );
+        names.push_back( std::string() );
+        names.back().swap( name );
+        return true;
+    }
+    bool close( char type ) {
+        std::string key;
+        key.swap( names.back() );
+        names.pop_back();
+        indent();
+        close_tag( type, key );
+        out.put( '\n' );
+        return true;
+    }
+
+    Sink &out;
+    const unsigned format;
+    const std::string root_attrib;
+    std::string name;                // of the next value; empty in arrays
+    std::vector<std::string> names;  // of the open containers
+    std::string scratch;
+};
+
+// order here matches jsonxx::Format enum
+const char *defheader[] = {
+    "",
+
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+         JSONXX_XML_TAG "\n",
+
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+         JSONXX_XML_TAG "\n",
+
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+         JSONXX_XML_TAG "\n",
+
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+         JSONXX_XML_TAG "\n"
+};
+
+// order here matches jsonxx::Format enum
+const char *defrootattrib[] = {
+    "",
+
+    " xsi:schemaLocation=\"http://www.datapower.com/schemas/json jsonx.xsd\""
+        " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+        " xmlns:json=\"http://www.ibm.com/xmlns/prod/2009/jsonx\"",
+
+    "",
+
+    "",
+
+    ""
+};
+
+template<typename Sink, typename Root>
+void write_document( Sink &out, const Root &root, unsigned format,
+                     const std::string &header, const std::string &attrib ) {
+    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+
+    const std::string &head = header.empty() ? std::string( defheader[format] ) : header;
+    out.write( head.data(), head.size() );
+    Writer<Sink> writer( out, format, attrib.empty() ? std::string( defrootattrib[format] ) : attrib );
+    Emitter< Writer<Sink> >( writer ).run( root );
+}
+
+} // namespace jsonxx::anon::xml
+
+} // namespace jsonxx::anon
+
+std::string Object::json() const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    json::write_document( sink, *this, false );
+    probe.wrote( *this, result.size(), json_escapes );
+    return result;
+}
+
+std::string Object::json( const WriteOptions &options ) const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    json::ParallelWriter<StringSink>( sink, options ).run( *this );
+    probe.wrote( *this, result.size(), json_escapes );
+    return result;
+}
+
+void Object::json( std::ostream &output, const WriteOptions &options ) const {
+    Probe probe;
+    BufferedSink sink( output );
+    json::ParallelWriter<BufferedSink>( sink, options ).run( *this );
+    sink.flush();
+    probe.wrote( *this, sink.written(), json_escapes );
+}
+
+std::string Object::xml( unsigned format, const std::string &header, const std::string &attrib ) const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    xml::write_document( sink, *this, format, header, attrib );
+    probe.wrote( *this, result.size(), xml_escapes[ format < 5 ? format : 0 ] );
+    return result;
+}
+
+void Object::xml( std::ostream &output, unsigned format, const std::string &header, const std::string &attrib ) const {
+    Probe probe;
+    BufferedSink sink( output );
+    xml::write_document( sink, *this, format, header, attrib );
+    sink.flush();
+    probe.wrote( *this, sink.written(), xml_escapes[ format < 5 ? format : 0 ] );
+}
+
+std::string Array::json() const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    json::write_document( sink, *this, false );
+    probe.wrote( *this, result.size(), json_escapes );
+    return result;
+}
+
+std::string Array::json( const WriteOptions &options ) const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    json::ParallelWriter<StringSink>( sink, options ).run( *this );
+    probe.wrote( *this, result.size(), json_escapes );
+    return result;
+}
+
+void Array::json( std::ostream &output, const WriteOptions &options ) const {
+    Probe probe;
+    BufferedSink sink( output );
+    json::ParallelWriter<BufferedSink>( sink, options ).run( *this );
+    sink.flush();
+    probe.wrote( *this, sink.written(), json_escapes );
+}
+
+std::string Array::xml( unsigned format, const std::string &header, const std::string &attrib ) const {
+    Probe probe;
+    std::string result;
+    StringSink sink( result );
+    xml::write_document( sink, *this, format, header, attrib );
+    probe.wrote( *this, result.size(), xml_escapes[ format < 5 ? format : 0 ] );
+    return result;
+}
+
+void Array::xml( std::ostream &output, unsigned format, const std::string &header, const std::string &attrib ) const {
+    Probe probe;
+    BufferedSink sink( output );
+    xml::write_document( sink, *this, format, header, attrib );
+    sink.flush();
+    probe.wrote( *this, sink.written(), xml_escapes[ format < 5 ? format : 0 ] );
+}
+
+namespace {
+
+// Walker handler for validate(): checks the grammar and nothing else.
+// With ParseOptions::utf8 its Text is a Utf8Sink instead of a Discard.
+template<typename Text_>
+struct Checker {
+    typedef Text_ Text;
+    typedef Discard Digits;
+
+    bool null() { return true; }
+    bool boolean( bool ) { return true; }
+    bool number( Discard & ) { return true; }
+    bool string( Text & ) { return true; }
+    bool key( Text & ) { return true; }
+    bool begin_object() { return true; }
+    bool end_object() { return true; }
+    bool begin_array() { return true; }
+    bool end_array() { return true; }
+};
+
+// Only objects and arrays are documents, and nothing but whitespace (or
+// comments) may follow them.
+template<typename P, typename Text, typename Reader>
+bool validate_document( Reader &in, const ParseOptions &options ) {
+    Checker<Text> checker;
+    if( !skip_space<P>(in) || (in.peek() != '{' && in.peek() != '[') )
+        return false;
+    if( !run_walker<P>( in, checker, options ) )
+        return false;
+    return skip_space<P>(in) && in.peek() < 0;
+}
+
+template<typename Reader>
+class ValidateTask {
+  public:
+    ValidateTask( Reader &input, const ParseOptions &options ) : in(input), options(options) {}
+    template<typename P> bool run() {
+        return options.utf8 ? validate_document<P, Utf8Sink>( in, options )
+                            : validate_document<P, Discard>( in, options );
+    }
+  private:
+    Reader &in;
+    const ParseOptions &options;
+};
+
+template<typename Reader>
+bool validate_document( Reader &in, size_t &error_offset, const ParseOptions &options ) {
+    Probe probe;
+    ValidateTask<Reader> task( in, options );
+    const bool valid = dispatch( options, task );
+    Probe::read( in.offset() );
+    if( !valid )
+        error_offset = in.offset();
+    return valid;
+}
+
+} // namespace jsonxx::anon
+
+bool validate( std::istream &input, size_t &error_offset, const ParseOptions &options ) {
+    StreamReader in( input );
+    return validate_document( in, error_offset, options );
+}
+
+bool validate( std::istream &input ) {
+    size_t error_offset;
+    return jsonxx::validate( input, error_offset );
+}
+
+bool validate( const std::string &input, size_t &error_offset, const ParseOptions &options ) {
+    BufferReader in( input.data(), input.size() );
+    return validate_document( in, error_offset, options );
+}
+
+bool validate( const std::string &input ) {
+    size_t error_offset;
+    return jsonxx::validate( input, error_offset );
+}
+
+bool validate_utf8( const std::string &input, size_t &error_offset ) {
+    const size_t valid = utf8_prefix( input.data(), input.size() );
+    if( valid == input.size() )
+        return true;
+    error_offset = valid;
+    return false;
+}
+
+bool validate_utf8( const std::string &input ) {
+    size_t error_offset;
+    return validate_utf8( input, error_offset );
+}
+
+namespace {
+
+// Runs a Walker over one document (an object or an array) for a handler
+// that does not depend on the policy, such as the streaming writers.
+template<typename Reader, typename Handler>
+class WalkTask {
+  public:
+    WalkTask( Reader &input, Handler &handler, const ParseOptions &options, const Escape *escapes )
+        : in(input), out(handler), options(options), escapes(escapes) {}
+    template<typename P> bool run() {
+        return skip_space<P>(in) && (in.peek() == '{' || in.peek() == '[') &&
+               run_walker<P>( in, out, options, escapes );
+    }
+  private:
+    Reader &in;
+    Handler &out;
+    const ParseOptions &options;
+    const Escape *escapes;  // of the writer, for a Census
+};
+
+// The object or array input starts with, built as parse() builds it, for
+// the conversions that write a document: members come out sorted by key,
+// and a key given twice keeps its last value.
+template<typename Reader>
+bool read_root( Reader &in, Value &root ) {
+    return read_document( in, root, ParseOptions() ) && ( root.is<Object>() || root.is<Array>() );
+}
+
+// JSON text to XML without building a document: memory is bounded by the
+// nesting depth and the longest string.
+template<typename Reader, typename Sink>
+bool convert_xml( Reader &in, Sink &out, unsigned format, const ParseOptions &options ) {
+    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+
+    Probe probe;
+    out.write( xml::defheader[format], std::strlen( xml::defheader[format] ) );
+    xml::Writer<Sink> writer( out, format, xml::defrootattrib[format] );
+    WalkTask<Reader, xml::Writer<Sink> > task( in, writer, options, xml_escapes[format] );
+    const bool converted = dispatch( options, task );
+    Probe::read( in.offset() );
+    Probe::wrote( out.written() );
+    return converted;
+}
+
+// The same for JSON: pretty-printed as json() does, or compact.
+template<typename Reader, typename Sink>
+bool convert_json( Reader &in, Sink &out, bool compact, const ParseOptions &options ) {
+    Probe probe;
+    json::Writer<Sink> writer( out, compact );
+    WalkTask<Reader, json::Writer<Sink> > task( in, writer, options, json_escapes );
+    const bool converted = dispatch( options, task );
+    if( converted )
+        writer.finish();
+    Probe::read( in.offset() );
+    Probe::wrote( out.written() );
+    return converted;
+}
+
+} // namespace jsonxx::anon
+
+std::string reformat( std::istream &input ) {
+    StreamReader in( input );
+    Value root;
+    if( read_root( in, root ) )
+        return root.is<Object>() ? root.get<Object>().json() : root.get<Array>().json();
+
+    // bad json input
+    return std::string();
+}
+
+bool reformat( std::istream &input, std::ostream &output, bool compact, const ParseOptions &options ) {
+    StreamReader in( input );
+    BufferedSink sink( output );
+    return convert_json( in, sink, compact, options );
+}
+
+std::string reformat( const std::string &input ) {
+    BufferReader in( input.data(), input.size() );
+    Value root;
+    if( read_root( in, root ) )
+        return root.is<Object>() ? root.get<Object>().json() : root.get<Array>().json();
+
+    // bad json input
+    return std::string();
+}
+
+std::string xml( std::istream &input, unsigned format ) {
+    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+    StreamReader in( input );
+    Value root;
+    if( read_root( in, root ) )
+        return root.is<Object>() ? root.get<Object>().xml( format ) : root.get<Array>().xml( format );
+
+    // bad json, return empty xml
+    return xml::defheader[format];
+}
+
+bool xml( std::istream &input, std::ostream &output, unsigned format, const ParseOptions &options ) {
+    StreamReader in( input );
+    BufferedSink sink( output );
+    return convert_xml( in, sink, format, options );
+}
+
+std::string xml( const std::string &input, unsigned format ) {
+    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+    BufferReader in( input.data(), input.size() );
+    Value root;
+    if( read_root( in, root ) )
+        return root.is<Object>() ? root.get<Object>().xml( format ) : root.get<Array>().xml( format );
+
+    // bad json, return empty xml
+    return xml::defheader[format];
+}
+
+
+Object::Object(const Object &other) : body_(0), value_map_(none()) {
+  import(other);
+}
+Object::Object(const std::string &key, const Value &value) : body_(0), value_map_(none()) {
+  import(key,value);
+}
+Object::container &Object::unshare( bool leak ) {
+  if( !body_ ) {
+    body_ = new Body();
+  } else if( body_->refs > 1 ) {
+    Body *copy = new Body();
+    Copier copier;
+    copier.copy( body_->values, copy->values );
+    copier.finish();
+    drop( body_ );
+    body_ = copy;
+  }
+  if( leak )
+    body_->leaked = true;
+  body_->hash.store( 0, std::memory_order_relaxed );
+  value_map_ = &body_->values;
+  return body_->values;
+}
+void Object::import( const Object &other ) {
+  odd.clear();
+  if (this == &other || other.empty()) {
+    return;
+  }
+  if (!body_ && Internal::adopt(*this, other)) {
+    return;
+  }
+  container &members = unshare();
+  Copier copier;
+  for (container::const_iterator it = other.value_map_->begin(); it != other.value_map_->end(); ++it) {
+    Value *copy = new Value();
+    std::pair<container::iterator, bool> slot = members.insert( std::make_pair( it->first, copy ) );
+    if( !slot.second ) {
+      delete slot.first->second;
+      slot.first->second = copy;
+    }
+    copier.copy( *it->second, *copy );
+  }
+  copier.finish();
+}
+void Object::import( const std::string &key, const Value &value ) {
+  odd.clear();
+  Value *copy = new Value( value );
+  container &members = unshare();
+  container::iterator found = members.find(key);
+  if( found != members.end() ) {
+    delete found->second;
+    found->second = copy;
+  } else {
+    members.insert( found, std::make_pair( key, copy ) );
+  }
+}
+Object &Object::operator=(const Object &other) {
+  odd.clear();
+  if (this != &other) {
+    // copied first: other may live inside this object
+    Object copy(other);
+    std::swap(body_, copy.body_);
+    std::swap(value_map_, copy.value_map_);
+  }
+  return *this;
+}
+Object &Object::operator<<(const Value &value) {
+  if (odd.empty()) {
+    odd = value.get<String>();
+  } else {
+    import( Object(odd, value) );
+    odd.clear();
+  }
+  return *this;
+}
+Object &Object::operator<<(const Object &value) {
+  import( std::string(odd),value);
+  odd.clear();
+  return *this;
+}
+size_t Object::size() const {
+  return value_map_->size();
+}
+bool Object::empty() const {
+  return value_map_->empty();
+}
+const std::map<std::string, Value*> &Object::kv_map() const {
+  return *value_map_;
+}
+const std::map<std::string, Value*> &Object::kv_map() {
+  return unshare( true );
+}
+std::string Object::write( unsigned format ) const {
+  return format == JSON ? json() : xml(format);
+}
+void Object::reset() {
+  Body *body = body_;
+  body_ = 0;
+  value_map_ = none();
+  drop(body);
+}
+bool Object::parse(std::istream &input) {
+  return parse(input,*this);
+}
+bool Object::parse(const std::string &input) {
+  return parse(input, ParseOptions());
+}
+bool Object::parse(std::istream &input, const ParseOptions &options) {
+  StreamReader in( input );
+  return read_document(in, *this, options);
+}
+bool Object::parse(const std::string &input, const ParseOptions &options) {
+  BufferReader in( input.data(), input.size() );
+  return read_document(in, *this, options);
+}
+
+
+Array::Array(const Array &other) : body_(0), values_(none()) {
+  import(other);
+}
+Array::Array(const Value &value) : body_(0), values_(none()) {
+  import(value);
+}
+Array::container &Array::unshare( bool leak ) {
+  if( !body_ ) {
+    body_ = new Body();
+  } else if( body_->refs > 1 ) {
+    Body *copy = new Body();
+    Copier copier;
+    copier.copy( body_->values, copy->values );
+    copier.finish();
+    drop( body_ );
+    body_ = copy;
+  }
+  if( leak )
+    body_->leaked = true;
+  body_->hash.store( 0, std::memory_order_relaxed );
+  values_ = &body_->values;
+  return body_->values;
+}
+void Array::append(const Array &other) {
+  Value *copy = new Value(other);
+  unshare().push_back( copy );
+}
+void Array::import(const Array &other) {
+  if (other.empty()) {
+    return;
+  }
+  if (!body_ && Internal::adopt(*this, other)) {
+    return;
+  }
+  // other may be this array: copy before appending
+  container copies;
+  Copier copier;
+  copier.copy( *other.values_, copies );
+  copier.finish();
+  container &elements = unshare();
+  elements.insert( elements.end(), copies.begin(), copies.end() );
+}
+void Array::import(const Value &value) {
+  Value *copy = new Value(value);
+  unshare().push_back( copy );
+}
+size_t Array::size() const {
+  return values_->size();
+}
+bool Array::empty() const {
+  return values_->empty();
+}
+void Array::reset() {
+  Body *body = body_;
+  body_ = 0;
+  values_ = none();
+  drop(body);
+}
+bool Array::parse(std::istream &input) {
+  return parse(input,*this);
+}
+bool Array::parse(const std::string &input) {
+  return parse(input, ParseOptions());
+}
+bool Array::parse(std::istream &input, const ParseOptions &options) {
+  StreamReader in( input );
+  return read_document(in, *this, options);
+}
+bool Array::parse(const std::string &input, const ParseOptions &options) {
+  Probe probe;
+  if( options.threads != 1 && input.size() >= options.min_parallel ) {
+    ParallelArrayTask task( input, *this, options );
+    if( dispatch( options, task ) ) {
+      Probe::read( input.size() );
+      return true;
+    }
+  }
+  BufferReader in( input.data(), input.size() );
+  return read_document(in, *this, options);
+}
+
+Stats::Stats()
+  : calls(0), bytes_read(0), bytes_written(0),
+    objects(0), arrays(0), strings(0), numbers(0), booleans(0), nulls(0), keys(0),
+    escapes_read(0), escapes_written(0), max_depth(0), allocations(0), nanoseconds(0) {}
+
+StatsScope::StatsScope( Stats &stats, unsigned long long (*allocations)() )
+  : previous_( tally.stats ), previous_allocations_( tally.allocations ) {
+  tally.stats = &stats;
+  tally.allocations = allocations;
+}
+StatsScope::~StatsScope() {
+  tally.stats = previous_;
+  tally.allocations = previous_allocations_;
+}
+
+PushParser::PushParser( Value &target, const ParseOptions &options )
+  : state_( push_state( target, options ) ) {}
+PushParser::PushParser( Object &target, const ParseOptions &options )
+  : state_( push_state( target, options ) ) {}
+PushParser::PushParser( Array &target, const ParseOptions &options )
+  : state_( push_state( target, options ) ) {}
+PushParser::~PushParser() {
+  delete state_;
+}
+bool PushParser::feed( const char *data, size_t size ) {
+  return state_->feed( data, size, false ) != FAILED;
+}
+bool PushParser::finish() {
+  return state_->feed( 0, 0, true ) == DONE;
+}
+bool PushParser::done() const {
+  return state_->step == DONE;
+}
+
+Snapshot::Snapshot() : root_( std::make_shared<const Object>() ) {}
+Snapshot::Snapshot( const Object &document ) : root_( std::make_shared<const Object>( document ) ) {}
+size_t Snapshot::size() const {
+  return root_->size();
+}
+bool Snapshot::empty() const {
+  return root_->empty();
+}
+
+// Readers count themselves in on one of two counters, picked by the epoch,
+// while they take a reference to the current snapshot. A writer swaps the
+// next one in, then twice flips the epoch and waits for the counter new
+// readers have just left to empty: any reader that could still see what
+// was replaced was counted on one of them before the swap. Flipping
+// first means a writer waits only for readers already under way, however
+// busy the holder.
+struct SnapshotHolder::State {
+    typedef std::shared_ptr<const Object> Root;
+    explicit State( const Root &root ) : current( new Root( root ) ), epoch( 0 ) {
+        readers[0] = 0;
+        readers[1] = 0;
+    }
+    ~State() {
+        delete current.load();
+    }
+    std::atomic<const Root *> current;
+    std::atomic<unsigned> epoch;
+    std::atomic<long> readers[2];
+    std::mutex writing;
+};
+
+SnapshotHolder::SnapshotHolder() : state_( new State( std::make_shared<const Object>() ) ) {}
+SnapshotHolder::SnapshotHolder( const Snapshot &initial ) : state_( new State( initial.root_ ) ) {}
+SnapshotHolder::~SnapshotHolder() {
+  delete state_;
+}
+Snapshot SnapshotHolder::load() const {
+  std::atomic<long> &readers = state_->readers[state_->epoch & 1];
+  ++readers;
+  Snapshot current( *state_->current.load() );
+  --readers;
+  return current;
+}
+void SnapshotHolder::store( const Snapshot &next ) {
+  const State::Root *replaced = new State::Root( next.root_ );
+  {
+    std::lock_guard<std::mutex> turn( state_->writing );
+    replaced = state_->current.exchange( replaced );
+    for( int flip = 0; flip < 2; ++flip ) {
+      const unsigned left = state_->epoch++;
+      while( state_->readers[left & 1] != 0 )
+        std::this_thread::yield();
+    }
+  }
+  delete replaced;
+}
+bool SnapshotHolder::reload( std::istream &input, const ParseOptions &options ) {
+  std::shared_ptr<Object> next = std::make_shared<Object>();
+  if( !next->parse( input, options ) )
+    return false;
+  store( Snapshot( std::move( next ) ) );
+  return true;
+}
+bool SnapshotHolder::reload( const std::string &input, const ParseOptions &options ) {
+  std::shared_ptr<Object> next = std::make_shared<Object>();
+  if( !next->parse( input, options ) )
+    return false;
+  store( Snapshot( std::move( next ) ) );
+  return true;
+}
+
+namespace {
+
+// A fast hash of bytes, eight at a time; not for use against adversaries.
+size_t hash_bytes( const char *data, size_t size ) {
+    const unsigned long long k = 0x9E3779B97F4A7C15ULL;
+    unsigned long long h = size * k;
+    size_t i = 0;
+    for( ; i + 8 <= size; i += 8 ) {
+        unsigned long long word;
+        std::memcpy( &word, data + i, 8 );
+        word *= k;
+        h = ( h ^ ( word ^ ( word >> 29 ) ) ) * k;
+    }
+    unsigned long long tail = 0;
+    std::memcpy( &tail, data + i, size - i );
+    h = ( h ^ tail ) * k;
+    h ^= h >> 32;
+    return size_t( h );
+}
+
+// What about the options can change the document parsed.
+unsigned long long option_bits( const ParseOptions &options, bool object ) {
+    return ( (unsigned long long)options.max_depth << 5 ) | ( options.permissive << 4 ) |
+           ( options.unquoted_keys << 3 ) | ( options.comments << 2 ) | ( options.utf8 << 1 ) | object;
+}
+
+} // namespace jsonxx::anon
+
+struct ParseCache::Shard {
+    struct Entry {
+        size_t hash;
+        unsigned long long options;
+        std::string input;
+        Value document;
+    };
+    typedef std::list<Entry> Entries;  // most recently used first
+
+    // Entries are found by the hash of their input and what about the
+    // parse can change the document, then their input is compared.
+    typedef std::pair<size_t, unsigned long long> Key;
+    struct KeyHash {
+        size_t operator()( const Key &key ) const {
+            return key.first ^ size_t( key.second * 0x9E3779B97F4A7C15ULL );
+        }
+    };
+    typedef std::unordered_map<Key, Entries::iterator, KeyHash> Index;
+
+    Shard() : capacity(0), hits(0), misses(0), evictions(0) {}
+
+    std::mutex lock;
+    size_t capacity;
+    Entries entries;
+    Index index;
+    unsigned long long hits, misses, evictions;
+};
+
+ParseCache::ParseCache( size_t capacity, unsigned shards )
+  : shards_( 0 ), count_( unsigned( std::max<size_t>( 1, std::min<size_t>( shards, capacity ) ) ) ) {
+  shards_ = new Shard[count_];
+  // no more shards than documents, so the capacities add up to the bound
+  for( unsigned i = 0; i < count_; ++i )
+    shards_[i].capacity = capacity / count_ + ( i < capacity % count_ );
+}
+ParseCache::~ParseCache() {
+  delete [] shards_;
+}
+bool ParseCache::parse( const std::string &input, Value &document, const ParseOptions &options ) {
+  return lookup( input, document, options, false );
+}
+bool ParseCache::parse( const std::string &input, Object &document, const ParseOptions &options ) {
+  Value found;
+  if( !lookup( input, found, options, true ) )
+    return false;
+  document = found.get<Object>();
+  return true;
+}
+bool ParseCache::lookup( const std::string &input, Value &document, const ParseOptions &options, bool object ) {
+  const size_t hash = hash_bytes( input.data(), input.size() );
+  const unsigned long long bits = option_bits( options, object );
+  const Shard::Key key( hash, bits );
+  Shard &shard = shards_[ ( Shard::KeyHash()( key ) >> 7 ) % count_ ];
+  Value hit;
+  {
+    std::lock_guard<std::mutex> held( shard.lock );
+    Shard::Index::iterator found = shard.index.find( key );
+    if( found != shard.index.end() && found->second->input == input ) {
+      shard.entries.splice( shard.entries.begin(), shard.entries, found->second );
+      ++shard.hits;
+      hit = found->second->document;
+    } else {
+      ++shard.misses;
+    }
+  }
+  if( !hit.empty() ) {
+    // assigned unlocked: what document held before may be large to free
+    document = hit;
+    return true;
+  }
+
+  // parsed outside the lock, so other lookups carry on meanwhile
+  Value parsed;
+  if( object ) {
+    Object o;
+    if( !o.parse( input, options ) )
+      return false;
+    parsed = o;
+  } else if( !parsed.parse( input, options ) ) {
+    return false;
+  }
+  document = parsed;
+
+  Shard::Entries added( 1 ), dropped;  // dropped is freed after unlocking
+  added.front().hash = hash;
+  added.front().options = bits;
+  added.front().input = input;
+  added.front().document = parsed;
+  std::lock_guard<std::mutex> held( shard.lock );
+  Shard::Index::iterator found = shard.index.find( key );
+  if( found != shard.index.end() ) {
+    // parsed twice at once, or another input with the same hash: the
+    // newer one stays
+    dropped.splice( dropped.end(), shard.entries, found->second );
+    shard.index.erase( found );
+  }
+  shard.entries.splice( shard.entries.begin(), added );
+  shard.index[key] = shard.entries.begin();
+  if( shard.entries.size() > shard.capacity ) {
+    shard.index.erase( Shard::Key( shard.entries.back().hash, shard.entries.back().options ) );
+    dropped.splice( dropped.end(), shard.entries, --shard.entries.end() );
+    ++shard.evictions;
+  }
+  return true;
+}
+ParseCache::Stats ParseCache::stats() const {
+  Stats total = { 0, 0, 0, 0 };
+  for( unsigned i = 0; i < count_; ++i ) {
+    std::lock_guard<std::mutex> held( shards_[i].lock );
+    total.hits += shards_[i].hits;
+    total.misses += shards_[i].misses;
+    total.evictions += shards_[i].evictions;
+    total.size += shards_[i].entries.size();
+  }
+  return total;
+}
+void ParseCache::clear() {
+  for( unsigned i = 0; i < count_; ++i ) {
+    Shard::Entries dropped;
+    {
+      std::lock_guard<std::mutex> held( shards_[i].lock );
+      shards_[i].index.clear();
+      dropped.swap( shards_[i].entries );
+    }
+  }
+}
+Array &Array::operator<<(const Array &other) {
+  import(other);
+  return *this;
+}
+Array &Array::operator<<(const Value &value) {
+  import(value);
+  return *this;
+}
+Array &Array::operator=(const Array &other) {
+  if( this != &other ) {
+    // copied first: other may live inside this array
+    Array copy(other);
+    std::swap(body_, copy.body_);
+    std::swap(values_, copy.values_);
+  }
+  return *this;
+}
+Array &Array::operator=(const Value &value) {
+  reset();
+  import(value);
+  return *this;
+}
+
+Value::Value(const Value &other) : type_(INVALID_) {
+  import( other );
+}
+Value &Value::operator=( const Value &other ) {
+  if (this != &other) {
+    // copied first: other may live inside this value
+    Value copy( other );
+    reset();
+    take( *this, copy );
+  }
+  return *this;
+}
+void Value::import( const Value &other ) {
+  if (this != &other) {
+    copy_node( other, *this );
+  }
+}
+bool Value::empty() const {
+  if( type_ == INVALID_ ) return true;
+  if( type_ == STRING_ && string_value_ == 0 ) return true;
+  if( type_ == ARRAY_ && array_value_ == 0 ) return true;
+  if( type_ == OBJECT_ && object_value_ == 0 ) return true;
+  return false;
+}
+bool Value::parse(std::istream &input) {
+  return parse(input,*this);
+}
+bool Value::parse(const std::string &input) {
+  return parse(input, ParseOptions());
+}
+bool Value::parse(std::istream &input, const ParseOptions &options) {
+  StreamReader in( input );
+  return read_document(in, *this, options);
+}
+bool Value::parse(const std::string &input, const ParseOptions &options) {
+  BufferReader in( input.data(), input.size() );
+  return read_document(in, *this, options);
+}
+
+namespace {
+
+typedef std::vector< std::pair<const Value*, const Value*> > Pairs;
+
+// The hash a container keeps, or 0 if there is none yet.
+template<typename Container>
+size_t known_hash( const Container &container ) {
+    const std::atomic<size_t> *slot = Internal::hash_slot( container );
+    return slot ? slot->load( std::memory_order_relaxed ) : 0;
+}
+
+// Containers whose hashes are known to differ cannot be equal.
+template<typename Container>
+bool may_be_equal( const Container &a, const Container &b ) {
+    const size_t x = known_hash( a ), y = known_hash( b );
+    return !x || !y || x == y;
+}
+
+// Queues the members of two objects for comparison; false if the objects
+// differ already. Objects that share their members are equal unread.
+bool compare_members( const Object &a, const Object &b, Pairs &pending ) {
+    const Object::container &xs = a.kv_map(), &ys = b.kv_map();
+    if( &xs == &ys )
+        return true;
+    if( xs.size() != ys.size() || !may_be_equal( a, b ) )
+        return false;
+    for( Object::container::const_iterator i = xs.begin(), j = ys.begin(); i != xs.end(); ++i, ++j ) {
+        if( i->first != j->first )
+            return false;
+        pending.push_back( std::make_pair( i->second, j->second ) );
+    }
+    return true;
+}
+
+bool compare_elements( const Array &a, const Array &b, Pairs &pending ) {
+    const Array::container &xs = a.values(), &ys = b.values();
+    if( &xs == &ys )
+        return true;
+    if( xs.size() != ys.size() || !may_be_equal( a, b ) )
+        return false;
+    for( size_t i = 0; i < xs.size(); ++i )
+        pending.push_back( std::make_pair( xs[i], ys[i] ) );
+    return true;
+}
+
+// Deep comparison of the queued pairs, without recursion; stops at the
+// first difference.
+bool equal( Pairs &pending ) {
+    while( !pending.empty() ) {
+        const Value &x = *pending.back().first, &y = *pending.back().second;
+        pending.pop_back();
+        if( &x == &y )
+            continue;
+        if( x.type_ != y.type_ )
+            return false;
+        switch( x.type_ ) {
+            case Value::NUMBER_:
+                if( x.number_value_ != y.number_value_ )
+                    return false;
+                break;
+            case Value::BOOL_:
+                if( x.bool_value_ != y.bool_value_ )
+                    return false;
+                break;
+            case Value::STRING_:
+                if( *x.string_value_ != *y.string_value_ )
+                    return false;
+                break;
+            case Value::ARRAY_:
+                if( !compare_elements( *x.array_value_, *y.array_value_, pending ) )
+                    return false;
+                break;
+            case Value::OBJECT_:
+                if( !compare_members( *x.object_value_, *y.object_value_, pending ) )
+                    return false;
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
 
-std::string reformat( std::istream &input ) {
+bool equal( const Value &a, const Value &b ) {
+    Pairs pending( 1, std::make_pair( &a, &b ) );
+    return equal( pending );
+}
 
-    // trim non-printable chars
-    for( char ch(0); !input.eof() && input.peek() <= 32; )
-        input.get(ch);
+const size_t hash_basis = size_t( 14695981039346656037ULL );
 
-    // validate json
-    if( input.peek() == '{' )
-    {
-        jsonxx::Object o;
-        if( parse_object( input, o ) )
-            return o.json();
-    }
-    else
-    if( input.peek() == '[' )
-    {
-        jsonxx::Array a;
-        if( parse_array( input, a ) )
-            return a.json();
-    }
+inline size_t mix( size_t hash, size_t bits ) {
+    return ( hash ^ bits ) * size_t( 1099511628211ULL );
+}
 
-    // bad json input
-    return std::string();
+size_t mix( size_t hash, const std::string &text ) {
+    hash = mix( hash, text.size() );
+    for( size_t i = 0; i < text.size(); ++i )
+        hash = mix( hash, byte( text[i] ) );
+    return hash;
 }
 
-std::string reformat( const std::string &input ) {
-    std::istringstream is( input );
-    return jsonxx::reformat( is );
+size_t hash_scalar( const Value &v ) {
+    size_t hash = mix( hash_basis, size_t( v.type_ ) );
+    if( v.type_ == Value::NUMBER_ ) {
+        // through double: long double has padding, and -0 == 0
+        const double d = double( v.number_value_ );
+        unsigned long long bits = 0;
+        if( d != 0 )
+            std::memcpy( &bits, &d, sizeof(d) );
+        hash = mix( hash, size_t( bits ^ ( bits >> 32 ) ) );
+    } else if( v.type_ == Value::BOOL_ ) {
+        hash = mix( hash, size_t( v.bool_value_ ) );
+    } else if( v.type_ == Value::STRING_ ) {
+        hash = mix( hash, *v.string_value_ );
+    }
+    return hash;
 }
 
-std::string xml( std::istream &input, unsigned format ) {
-    using namespace xml;
-    JSONXX_ASSERT( format == jsonxx::JSONx || format == jsonxx::JXML || format == jsonxx::JXMLex || format == jsonxx::TaggedXML );
+// A container being hashed: its members or elements are folded in one by
+// one, each container among them on a frame of its own.
+struct HashFrame {
+    explicit HashFrame( const Object &o )
+        : object(&o), array(0), hash( mix( mix( hash_basis, size_t( Value::OBJECT_ ) ), o.size() ) ),
+          member( o.kv_map().begin() ), index(0), sealed( !Internal::leaked( o ) ) {}
+    explicit HashFrame( const Array &a )
+        : object(0), array(&a), hash( mix( mix( hash_basis, size_t( Value::ARRAY_ ) ), a.size() ) ),
+          member(), index(0), sealed( !Internal::leaked( a ) ) {}
+
+    const Object *object;
+    const Array *array;
+    size_t hash;
+    Object::container::const_iterator member;
+    size_t index;
+    // No container in it has leaked its values (see Object::unshare()), so
+    // its hash can be kept: a change anywhere below is then made through
+    // the path to it, which drops the hashes kept on the way.
+    bool sealed;
+};
 
-    // trim non-printable chars
-    for( char ch(0); !input.eof() && input.peek() <= 32; )
-        input.get(ch);
+// Hashes the container on the stack, without recursion. Hashes already
+// kept are reused; with cache set, those worked out are kept in turn.
+size_t hash_frames( std::vector<HashFrame> &stack, bool cache ) {
+    for( ;; ) {
+        HashFrame &top = stack.back();
+        const Value *next = 0;
+        if( top.object && top.member != top.object->kv_map().end() ) {
+            top.hash = mix( top.hash, top.member->first );
+            next = top.member->second;
+            ++top.member;
+        } else if( top.array && top.index < top.array->size() ) {
+            next = top.array->values()[top.index++];
+        }
 
-    // validate json, then transform
-    if( input.peek() == '{' )
-    {
-        jsonxx::Object o;
-        if( parse_object( input, o ) )
-            return o.xml(format);
-    }
-    else
-    if( input.peek() == '[' )
-    {
-        jsonxx::Array a;
-        if( parse_array( input, a ) )
-            return a.xml(format);
+        if( next ) {
+            size_t hash;
+            if( next->type_ == Value::OBJECT_ ) {
+                if( !( hash = known_hash( *next->object_value_ ) ) ) {
+                    stack.push_back( HashFrame( *next->object_value_ ) );
+                    continue;
+                }
+            } else if( next->type_ == Value::ARRAY_ ) {
+                if( !( hash = known_hash( *next->array_value_ ) ) ) {
+                    stack.push_back( HashFrame( *next->array_value_ ) );
+                    continue;
+                }
+            } else {
+                hash = hash_scalar( *next );
+            }
+            top.hash = mix( top.hash, hash );
+            continue;
+        }
+
+        const size_t hash = top.hash ? top.hash : 1;  // 0 stands for unknown
+        const bool sealed = top.sealed;
+        if( cache && sealed ) {
+            std::atomic<size_t> *slot = top.object ? Internal::hash_slot( *top.object ) : Internal::hash_slot( *top.array );
+            if( slot )
+                slot->store( hash, std::memory_order_relaxed );
+        }
+        stack.pop_back();
+        if( stack.empty() )
+            return hash;
+        stack.back().hash = mix( stack.back().hash, hash );
+        stack.back().sealed = stack.back().sealed && sealed;
     }
+}
 
-    // bad json, return empty xml
-    return defheader[format];
+template<typename Container>
+size_t hash_container( const Container &container, bool cache ) {
+    if( const size_t hash = known_hash( container ) )
+        return hash;
+    std::vector<HashFrame> stack( 1, HashFrame( container ) );
+    return hash_frames( stack, cache );
 }
 
-std::string xml( const std::string &input, unsigned format ) {
-    std::istringstream is( input );
-    return jsonxx::xml( is, format );
+// The hash of a value's contents: equal values hash alike. A value holding
+// a container hashes as the container does.
+size_t hash_value( const Value &v, bool cache = false ) {
+    if( v.type_ == Value::OBJECT_ )
+        return hash_container( *v.object_value_, cache );
+    if( v.type_ == Value::ARRAY_ )
+        return hash_container( *v.array_value_, cache );
+    return hash_scalar( v );
 }
 
+} // namespace jsonxx::anon
 
-Object::Object(const Object &other) {
-  import(other);
+bool operator==( const Value &a, const Value &b ) {
+    return equal( a, b );
 }
-Object::Object(const std::string &key, const Value &value) {
-  import(key,value);
+bool operator!=( const Value &a, const Value &b ) {
+    return !equal( a, b );
 }
-void Object::import( const Object &other ) {
-  odd.clear();
-  if (this != &other) {
-    // default
-    container::const_iterator
-        it = other.value_map_.begin(),
-        end = other.value_map_.end();
-    for (/**/ ; it != end ; ++it) {
-      container::iterator found = value_map_.find(it->first);
-      if( found != value_map_.end() ) {
-        delete found->second;
-      }
-      value_map_[ it->first ] = new Value( *it->second );
-    }
-  } else {
-    // recursion is supported here
-    import( Object(*this) );
-  }
+bool operator==( const Object &a, const Object &b ) {
+    Pairs pending;
+    return compare_members( a, b, pending ) && equal( pending );
 }
-void Object::import( const std::string &key, const Value &value ) {
-  odd.clear();
-  container::iterator found = value_map_.find(key);
-  if( found != value_map_.end() ) {
-    delete found->second;
-  }
-  value_map_[ key ] = new Value( value );
+bool operator!=( const Object &a, const Object &b ) {
+    return !( a == b );
 }
-Object &Object::operator=(const Object &other) {
-  odd.clear();
-  if (this != &other) {
-    reset();
-    import(other);
-  }
-  return *this;
+bool operator==( const Array &a, const Array &b ) {
+    Pairs pending;
+    return compare_elements( a, b, pending ) && equal( pending );
 }
-Object &Object::operator<<(const Value &value) {
-  if (odd.empty()) {
-    odd = value.get<String>();
-  } else {
-    import( Object(odd, value) );
-    odd.clear();
-  }
-  return *this;
+bool operator!=( const Array &a, const Array &b ) {
+    return !( a == b );
 }
-Object &Object::operator<<(const Object &value) {
-  import( std::string(odd),value);
-  odd.clear();
-  return *this;
+
+size_t Value::hash( bool cache ) const {
+  return hash_value( *this, cache );
 }
-size_t Object::size() const {
-  return value_map_.size();
+size_t Object::hash( bool cache ) const {
+  return hash_container( *this, cache );
 }
-bool Object::empty() const {
-  return value_map_.size() == 0;
+size_t Array::hash( bool cache ) const {
+  return hash_container( *this, cache );
 }
-const std::map<std::string, Value*> &Object::kv_map() const {
-  return value_map_;
+
+namespace {
+
+// Heap bytes behind a string: none while the text fits inside it.
+size_t text_bytes( const std::string &text ) {
+    const char *data = text.data();
+    const char *self = reinterpret_cast<const char *>( &text );
+    return data >= self && data < self + sizeof(text) ? 0 : text.capacity() + 1;
 }
-std::string Object::write( unsigned format ) const {
-  return format == JSON ? json() : xml(format);
+
+// Adds up what a document holds, without recursion. Containers shared
+// with copies are remembered, so one held twice counts once.
+class Meter {
+  public:
+    explicit Meter( MemoryUsage &usage ) : usage(usage) {}
+
+    void value( const Value &v, bool shared ) {
+        switch( v.type_ ) {
+            case Value::OBJECT_:
+                add( usage.objects, sizeof(Value), shared );
+                object( *v.object_value_, shared );
+                break;
+            case Value::ARRAY_:
+                add( usage.arrays, sizeof(Value), shared );
+                array( *v.array_value_, shared );
+                break;
+            case Value::STRING_:
+                ++usage.strings.count;
+                add( usage.strings, sizeof(Value) + sizeof(String) + text_bytes( *v.string_value_ ), shared );
+                break;
+            case Value::NUMBER_:
+                ++usage.numbers.count;
+                add( usage.numbers, sizeof(Value), shared );
+                break;
+            case Value::BOOL_:
+                ++usage.booleans.count;
+                add( usage.booleans, sizeof(Value), shared );
+                break;
+            default:
+                ++usage.nulls.count;
+                add( usage.nulls, sizeof(Value), shared );
+                break;
+        }
+    }
+    void object( const Object &o, bool shared ) {
+        ++usage.objects.count;
+        add( usage.objects, sizeof(Object), shared );
+        if( !held( Internal::body( o, size, joint ), shared ) )
+            return;
+        const Object::container &members = o.kv_map();
+        size_t bytes = size + members.size() * ( 4 * sizeof(void *) + sizeof(Object::container::value_type) );
+        for( Object::container::const_iterator it = members.begin(); it != members.end(); ++it ) {
+            bytes += text_bytes( it->first );
+            pending.push_back( Item( it->second, shared ) );
+        }
+        add( usage.objects, bytes, shared );
+    }
+    void array( const Array &a, bool shared ) {
+        ++usage.arrays.count;
+        add( usage.arrays, sizeof(Array), shared );
+        if( !held( Internal::body( a, size, joint ), shared ) )
+            return;
+        const Array::container &elements = a.values();
+        add( usage.arrays, size + elements.capacity() * sizeof(Value *), shared );
+        for( size_t i = 0; i < elements.size(); ++i )
+            pending.push_back( Item( elements[i], shared ) );
+    }
+    void run() {
+        while( !pending.empty() ) {
+            const Item next = pending.back();
+            pending.pop_back();
+            value( *next.first, next.second );
+        }
+    }
+
+  private:
+    typedef std::pair<const Value *, bool> Item;  // and whether shared
+
+    // Whether the values in body are to be counted: it exists and was not
+    // counted before. shared becomes true below a body copies share.
+    bool held( const void *body, bool &shared ) {
+        if( !body )
+            return false;
+        if( !joint )
+            return true;
+        shared = true;
+        return seen.insert( body ).second;
+    }
+    void add( MemoryUsage::Part &part, size_t bytes, bool shared ) {
+        part.bytes += bytes;
+        if( shared )
+            usage.shared += bytes;
+    }
+
+    MemoryUsage &usage;
+    std::vector<Item> pending;
+    std::unordered_set<const void *> seen;
+    size_t size;  // of the body last looked at
+    bool joint;   // whether copies share it
+};
+
+} // namespace jsonxx::anon
+
+MemoryUsage::MemoryUsage() : shared(0) {
+  const Part none = { 0, 0 };
+  objects = arrays = strings = numbers = booleans = nulls = none;
 }
-void Object::reset() {
-  container::iterator i;
-  for (i = value_map_.begin(); i != value_map_.end(); ++i) {
-    delete i->second;
-  }
-  value_map_.clear();
+size_t MemoryUsage::bytes() const {
+  return objects.bytes + arrays.bytes + strings.bytes + numbers.bytes + booleans.bytes + nulls.bytes;
 }
-bool Object::parse(std::istream &input) {
-  return parse(input,*this);
+
+MemoryUsage Value::memory_usage() const {
+  MemoryUsage usage;
+  Meter meter( usage );
+  meter.value( *this, false );
+  meter.run();
+  return usage;
 }
-bool Object::parse(const std::string &input) {
-  std::istringstream is( input );
-  return parse(is,*this);
+MemoryUsage Object::memory_usage() const {
+  MemoryUsage usage;
+  Meter meter( usage );
+  meter.object( *this, false );
+  meter.run();
+  return usage;
+}
+MemoryUsage Array::memory_usage() const {
+  MemoryUsage usage;
+  Meter meter( usage );
+  meter.array( *this, false );
+  meter.run();
+  return usage;
 }
 
+namespace {
 
-Array::Array(const Array &other) {
-  import(other);
+typedef std::vector<std::string> Pointer;
+
+// Splits an RFC 6901 JSON Pointer into its reference tokens, unescaped.
+bool split_pointer( const std::string &text, Pointer &tokens ) {
+    tokens.clear();
+    if( text.empty() )
+        return true;
+    if( text[0] != '/' )
+        return false;
+    for( size_t i = 1; ; ++i ) {
+        std::string token;
+        for( ; i < text.size() && text[i] != '/'; ++i ) {
+            char c = text[i];
+            if( c == '~' ) {
+                if( ++i == text.size() )
+                    return false;
+                if( text[i] == '0' )
+                    c = '~';
+                else if( text[i] == '1' )
+                    c = '/';
+                else
+                    return false;
+            }
+            token += c;
+        }
+        tokens.push_back( token );
+        if( i == text.size() )
+            return true;
+    }
 }
-Array::Array(const Value &value) {
-  import(value);
+
+// An array index token: decimal digits, without leading zeros.
+bool array_index( const std::string &token, size_t &index ) {
+    if( token.empty() || token.size() > 18 || ( token[0] == '0' && token.size() > 1 ) )
+        return false;
+    index = 0;
+    for( size_t i = 0; i < token.size(); ++i ) {
+        if( token[i] < '0' || token[i] > '9' )
+            return false;
+        index = index * 10 + ( token[i] - '0' );
+    }
+    return true;
 }
-void Array::append(const Array &other) {
-    if (this != &other) {
-        values_.push_back( new Value(other) );
-    } else {
-        append( Array(*this) );
+
+// The value the first n tokens lead to from root, or 0.
+const Value *find( const Value &root, const Pointer &tokens, size_t n ) {
+    const Value *at = &root;
+    for( size_t i = 0; i < n; ++i ) {
+        size_t index;
+        if( at->type_ == Value::OBJECT_ ) {
+            const Object::container &members = as_const( *at->object_value_ ).kv_map();
+            Object::container::const_iterator it = members.find( tokens[i] );
+            if( it == members.end() )
+                return 0;
+            at = it->second;
+        } else if( at->type_ == Value::ARRAY_ && array_index( tokens[i], index ) &&
+                   index < at->array_value_->size() ) {
+            at = as_const( *at->array_value_ ).values()[index];
+        } else {
+            return 0;
+        }
     }
+    return at;
 }
-void Array::import(const Array &other) {
-  if (this != &other) {
-    // default
-    container::const_iterator
-        it = other.values_.begin(),
-        end = other.values_.end();
-    for (/**/ ; it != end; ++it) {
-      values_.push_back( new Value(**it) );
+
+// As above, making the containers on the way this document's own, so
+// what is found may be changed. Nothing off the path is touched.
+Value *find( Value &root, const Pointer &tokens, size_t n ) {
+    Value *at = &root;
+    for( size_t i = 0; i < n; ++i ) {
+        size_t index;
+        if( at->type_ == Value::OBJECT_ ) {
+            if( !as_const( *at->object_value_ ).kv_map().count( tokens[i] ) )
+                return 0;
+            at = Internal::members( *at->object_value_ ).find( tokens[i] )->second;
+        } else if( at->type_ == Value::ARRAY_ && array_index( tokens[i], index ) &&
+                   index < at->array_value_->size() ) {
+            at = Internal::elements( *at->array_value_ )[index];
+        } else {
+            return 0;
+        }
     }
-  } else {
-    // recursion is supported here
-    import( Array(*this) );
-  }
+    return at;
 }
-void Array::import(const Value &value) {
-  values_.push_back( new Value(value) );
+
+// Takes the value at tokens out of the document; 0 if there is none.
+Value *detach( Value &root, const Pointer &tokens ) {
+    Value *parent = tokens.empty() ? 0 : find( root, tokens, tokens.size() - 1 );
+    size_t index;
+    if( !parent ) {
+        return 0;
+    } else if( parent->type_ == Value::OBJECT_ ) {
+        if( !as_const( *parent->object_value_ ).kv_map().count( tokens.back() ) )
+            return 0;
+        Object::container &members = Internal::members( *parent->object_value_ );
+        Object::container::iterator it = members.find( tokens.back() );
+        Value *v = it->second;
+        members.erase( it );
+        return v;
+    } else if( parent->type_ == Value::ARRAY_ && array_index( tokens.back(), index ) &&
+               index < parent->array_value_->size() ) {
+        Array::container &elements = Internal::elements( *parent->array_value_ );
+        Value *v = elements[index];
+        elements.erase( elements.begin() + index );
+        return v;
+    }
+    return 0;
 }
-size_t Array::size() const {
-  return values_.size();
+
+// Puts value at tokens, taking it over: an added member or inserted
+// element, or with replace set the value already there. The whole
+// document is replaced only by a value of root_type (any, if INVALID_).
+// On failure value stays the caller's.
+bool attach( Value &root, const Pointer &tokens, Value *value, bool replace, int root_type ) {
+    if( tokens.empty() ) {
+        if( root_type != Value::INVALID_ && value->type_ != root_type )
+            return false;
+        root.reset();
+        take( root, *value );
+        delete value;
+        return true;
+    }
+    Value *parent = find( root, tokens, tokens.size() - 1 );
+    size_t index;
+    if( parent && parent->type_ == Value::OBJECT_ &&
+        ( !replace || as_const( *parent->object_value_ ).kv_map().count( tokens.back() ) ) ) {
+        Object::container &members = Internal::members( *parent->object_value_ );
+        std::pair<Object::container::iterator, bool> slot = members.insert( std::make_pair( tokens.back(), value ) );
+        if( !slot.second ) {
+            delete slot.first->second;
+            slot.first->second = value;
+        }
+        return true;
+    }
+    if( parent && parent->type_ == Value::ARRAY_ ) {
+        const size_t size = parent->array_value_->size();
+        if( !replace && tokens.back() == "-" ) {
+            Internal::elements( *parent->array_value_ ).push_back( value );
+            return true;
+        }
+        if( array_index( tokens.back(), index ) && ( replace ? index < size : index <= size ) ) {
+            Array::container &elements = Internal::elements( *parent->array_value_ );
+            if( replace ) {
+                delete elements[index];
+                elements[index] = value;
+            } else {
+                elements.insert( elements.begin() + index, value );
+            }
+            return true;
+        }
+    }
+    return false;
 }
-bool Array::empty() const {
-  return values_.size() == 0;
+
+// As attach(), for a copy of value.
+bool attach_copy( Value &root, const Pointer &tokens, const Value &value, bool replace, int root_type ) {
+    Value *copy = new Value( value );
+    if( attach( root, tokens, copy, replace, root_type ) )
+        return true;
+    delete copy;
+    return false;
 }
-void Array::reset() {
-  for (container::iterator i = values_.begin(); i != values_.end(); ++i) {
-    delete *i;
-  }
-  values_.clear();
+
+const Value *member( const Object &object, const char *key ) {
+    Object::container::const_iterator it = object.kv_map().find( key );
+    return it == object.kv_map().end() ? 0 : it->second;
 }
-bool Array::parse(std::istream &input) {
-  return parse(input,*this);
+
+bool apply_patch( Value &root, const Array &operations, int root_type ) {
+    Pointer path, from;
+    for( size_t i = 0; i < operations.size(); ++i ) {
+        if( !operations.has<Object>( i ) )
+            return false;
+        const Object &operation = operations.get<Object>( i );
+        if( !operation.has<String>( "op" ) || !operation.has<String>( "path" ) ||
+            !split_pointer( operation.get<String>( "path" ), path ) )
+            return false;
+        const std::string &op = operation.get<String>( "op" );
+        const Value *value = member( operation, "value" );
+        if( op == "move" || op == "copy" ) {
+            if( !operation.has<String>( "from" ) || !split_pointer( operation.get<String>( "from" ), from ) )
+                return false;
+        }
+
+        if( op == "add" || op == "replace" ) {
+            if( !value || !attach_copy( root, path, *value, op == "replace", root_type ) )
+                return false;
+        } else if( op == "remove" ) {
+            Value *removed = detach( root, path );
+            if( !removed )
+                return false;
+            delete removed;
+        } else if( op == "move" ) {
+            // a value cannot move into itself
+            if( from.size() < path.size() && std::equal( from.begin(), from.end(), path.begin() ) )
+                return false;
+            if( from == path ) {
+                if( !find( static_cast<const Value&>( root ), path, path.size() ) )
+                    return false;
+                continue;
+            }
+            Value *moved = detach( root, from );
+            if( !moved )
+                return false;
+            if( !attach( root, path, moved, false, root_type ) ) {
+                // put back where it was, which the detach just left room for
+                attach( root, from, moved, false, root_type );
+                return false;
+            }
+        } else if( op == "copy" ) {
+            const Value *source = find( static_cast<const Value&>( root ), from, from.size() );
+            if( !source || !attach_copy( root, path, *source, false, root_type ) )
+                return false;
+        } else if( op == "test" ) {
+            const Value *target = find( static_cast<const Value&>( root ), path, path.size() );
+            if( !value || !target || !equal( *target, *value ) )
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
 }
-bool Array::parse(const std::string &input) {
-  std::istringstream is(input);
-  return parse(is,*this);
+
+// Merges changes into target, which becomes an object if it was not one.
+// Iterative, one object of the patch at a time.
+void merge_members( Value &target, const Object &changes ) {
+    std::vector< std::pair<Value*, const Object*> > pending( 1, std::make_pair( &target, &changes ) );
+    while( !pending.empty() ) {
+        Value &into = *pending.back().first;
+        const Object::container &patch = pending.back().second->kv_map();
+        pending.pop_back();
+        if( into.type_ != Value::OBJECT_ ) {
+            into.reset();
+            into.object_value_ = new Object();
+            into.type_ = Value::OBJECT_;
+        }
+        if( patch.empty() )
+            continue;
+        Object::container &members = Internal::members( *into.object_value_ );
+        for( Object::container::const_iterator it = patch.begin(); it != patch.end(); ++it ) {
+            Object::container::iterator found = members.find( it->first );
+            if( it->second->is<Null>() ) {
+                if( found != members.end() ) {
+                    delete found->second;
+                    members.erase( found );
+                }
+            } else if( it->second->is<Object>() ) {
+                if( found == members.end() )
+                    found = members.insert( found, std::make_pair( it->first, new Value() ) );
+                pending.push_back( std::make_pair( found->second, &it->second->get<Object>() ) );
+            } else if( found != members.end() ) {
+                found->second->import( *it->second );
+            } else {
+                members.insert( found, std::make_pair( it->first, new Value( *it->second ) ) );
+            }
+        }
+    }
 }
-Array &Array::operator<<(const Array &other) {
-  import(other);
-  return *this;
+
+} // namespace jsonxx::anon
+
+bool patch( Value &document, const Array &operations ) {
+    return apply_patch( document, operations, Value::INVALID_ );
 }
-Array &Array::operator<<(const Value &value) {
-  import(value);
-  return *this;
+
+bool patch( Object &document, const Array &operations ) {
+    Value root( ( Object() ) );
+    Internal::swap( document, *root.object_value_ );
+    const bool ok = apply_patch( root, operations, Value::OBJECT_ );
+    Internal::swap( document, *root.object_value_ );
+    return ok;
 }
-Array &Array::operator=(const Array &other) {
-  if( this != &other ) {
-    reset();
-    import(other);
-  }
-  return *this;
+
+bool patch( Array &document, const Array &operations ) {
+    Value root( ( Array() ) );
+    Internal::swap( document, *root.array_value_ );
+    const bool ok = apply_patch( root, operations, Value::ARRAY_ );
+    Internal::swap( document, *root.array_value_ );
+    return ok;
 }
-Array &Array::operator=(const Value &value) {
-  reset();
-  import(value);
-  return *this;
+
+void merge_patch( Value &document, const Value &patch ) {
+    if( patch.is<Object>() )
+        merge_members( document, patch.get<Object>() );
+    else if( &document != &patch )
+        document.import( Value( patch ) );
 }
 
-Value::Value(const Value &other) : type_(INVALID_) {
-  import( other );
+void merge_patch( Object &document, const Object &patch ) {
+    Value root( ( Object() ) );
+    Internal::swap( document, *root.object_value_ );
+    merge_members( root, patch );
+    Internal::swap( document, *root.object_value_ );
 }
-bool Value::empty() const {
-  if( type_ == INVALID_ ) return true;
-  if( type_ == STRING_ && string_value_ == 0 ) return true;
-  if( type_ == ARRAY_ && array_value_ == 0 ) return true;
-  if( type_ == OBJECT_ && object_value_ == 0 ) return true;
-  return false;
+
+namespace {
+
+// Both objects or both arrays: worth diffing member by member.
+bool same_kind( const Value &a, const Value &b ) {
+    return a.type_ == b.type_ && ( a.type_ == Value::OBJECT_ || a.type_ == Value::ARRAY_ );
 }
-bool Value::parse(std::istream &input) {
-  return parse(input,*this);
+
+// Builds a JSON Patch without recursion: each pair of containers queued
+// adds its own operations first, then queues the pairs below it, so the
+// paths of later operations hold once earlier ones are applied.
+class Differ {
+  public:
+    explicit Differ( Array &output ) : out(output) {}
+
+    void run( const Value &from, const Value &to ) {
+        compare( std::string(), from, to );
+        while( !pending.empty() ) {
+            const Work work = pending.back();
+            pending.pop_back();
+            if( work.from->type_ == Value::OBJECT_ )
+                members( work.path, *work.from->object_value_, *work.to->object_value_ );
+            else
+                elements( work.path, *work.from->array_value_, *work.to->array_value_ );
+        }
+    }
+
+  private:
+    struct Work {
+        std::string path;
+        const Value *from, *to;
+    };
+
+    void compare( const std::string &path, const Value &from, const Value &to ) {
+        if( &from == &to )
+            return;
+        if( same_kind( from, to ) ) {
+            Work work = { path, &from, &to };
+            pending.push_back( work );
+        } else if( !equal( from, to ) ) {
+            operation( "replace", path, &to );
+        }
+    }
+
+    void operation( const char *op, const std::string &path, const Value *value ) {
+        Object o;
+        o << "op" << op;
+        o << "path" << path;
+        if( value )
+            o << "value" << *value;
+        out << o;
+    }
+
+    static std::string child( const std::string &path, const std::string &token ) {
+        std::string pointer = path + '/';
+        for( size_t i = 0; i < token.size(); ++i ) {
+            if( token[i] == '~' )
+                pointer += "~0";
+            else if( token[i] == '/' )
+                pointer += "~1";
+            else
+                pointer += token[i];
+        }
+        return pointer;
+    }
+    static std::string child( const std::string &path, size_t index ) {
+        return path + '/' + std::to_string( index );
+    }
+
+    void members( const std::string &path, const Object &from, const Object &to ) {
+        const Object::container &a = from.kv_map(), &b = to.kv_map();
+        if( &a == &b )
+            return;
+        Object::container::const_iterator i = a.begin(), j = b.begin();
+        while( i != a.end() || j != b.end() ) {
+            if( j == b.end() || ( i != a.end() && i->first < j->first ) ) {
+                operation( "remove", child( path, i->first ), 0 );
+                ++i;
+            } else if( i == a.end() || j->first < i->first ) {
+                operation( "add", child( path, j->first ), j->second );
+                ++j;
+            } else {
+                compare( child( path, i->first ), *i->second, *j->second );
+                ++i, ++j;
+            }
+        }
+    }
+
+    // The same value, or the same shared container, or at least the same
+    // hash: an element to keep in place. Hashes are cached, so each
+    // container below is hashed once however deep it lies.
+    static bool alike( const Value &a, const Value &b ) {
+        if( &a == &b || ( a.type_ == Value::OBJECT_ && b.type_ == Value::OBJECT_ &&
+                          &as_const( *a.object_value_ ).kv_map() == &as_const( *b.object_value_ ).kv_map() ) ||
+            ( a.type_ == Value::ARRAY_ && b.type_ == Value::ARRAY_ &&
+              &as_const( *a.array_value_ ).values() == &as_const( *b.array_value_ ).values() ) )
+            return true;
+        return hash_value( a, true ) == hash_value( b, true );
+    }
+
+    // Matches the elements by the longest common subsequence of their
+    // hashes, past a common head and tail; unmatched runs are paired off
+    // as changes, the rest removed or added. Very long unmatched middles
+    // are paired off by position instead.
+    void elements( const std::string &path, const Array &from, const Array &to ) {
+        const Array::container &a = from.values(), &b = to.values();
+        if( &a == &b )
+            return;
+        size_t head = 0, tail = 0;
+        while( head < a.size() && head < b.size() && alike( *a[head], *b[head] ) )
+            ++head;
+        while( tail < a.size() - head && tail < b.size() - head &&
+               alike( *a[a.size() - 1 - tail], *b[b.size() - 1 - tail] ) )
+            ++tail;
+        const size_t n = a.size() - head - tail, m = b.size() - head - tail;
+        std::vector<size_t> ha( a.size() ), hb( b.size() );
+        for( size_t i = head; i < head + n; ++i )
+            ha[i] = hash_value( *a[i], true );
+        for( size_t j = head; j < head + m; ++j )
+            hb[j] = hash_value( *b[j], true );
+
+        // keep: both advance; take: from only (removed); give: to only (added)
+        std::string script( head, 'k' );
+        if( n && m && n <= ( size_t( 1 ) << 22 ) / m ) {
+            std::vector<unsigned> lcs( ( n + 1 ) * ( m + 1 ), 0 );
+            for( size_t i = n; i-- > 0; )
+                for( size_t j = m; j-- > 0; )
+                    lcs[i * ( m + 1 ) + j] = ha[head + i] == hb[head + j]
+                        ? lcs[( i + 1 ) * ( m + 1 ) + j + 1] + 1
+                        : std::max( lcs[( i + 1 ) * ( m + 1 ) + j], lcs[i * ( m + 1 ) + j + 1] );
+            size_t i = 0, j = 0;
+            while( i < n || j < m ) {
+                if( i < n && j < m && ha[head + i] == hb[head + j] ) {
+                    script += 'k', ++i, ++j;
+                } else if( j == m || ( i < n && lcs[( i + 1 ) * ( m + 1 ) + j] >= lcs[i * ( m + 1 ) + j + 1] ) ) {
+                    script += 't', ++i;
+                } else {
+                    script += 'g', ++j;
+                }
+            }
+        } else {
+            script.append( n, 't' );
+            script.append( m, 'g' );
+        }
+        script.append( tail, 'k' );
+
+        // j is both the index into to and the position in the array as
+        // patched so far. Kept elements hash alike, so they are almost
+        // always equal: equal() confirms it, and only a collision is
+        // compared further.
+        size_t i = 0, j = 0;
+        for( size_t at = 0; at < script.size(); ) {
+            if( script[at] == 'k' ) {
+                if( !equal( *a[i], *b[j] ) )
+                    compare( child( path, j ), *a[i], *b[j] );
+                ++i, ++j, ++at;
+                continue;
+            }
+            size_t takes = 0, gives = 0;
+            for( ; at < script.size() && script[at] != 'k'; ++at )
+                ++( script[at] == 't' ? takes : gives );
+            for( ; takes && gives; --takes, --gives, ++i, ++j )
+                compare( child( path, j ), *a[i], *b[j] );
+            for( ; takes; --takes, ++i )
+                operation( "remove", child( path, j ), 0 );
+            for( ; gives; --gives, ++j )
+                operation( "add", child( path, j ), b[j] );
+        }
+    }
+
+    Array &out;
+    std::vector<Work> pending;
+};
+
+} // namespace jsonxx::anon
+
+Array diff( const Value &from, const Value &to ) {
+    Array operations;
+    Differ( operations ).run( from, to );
+    return operations;
 }
-bool Value::parse(const std::string &input) {
-  std::istringstream is( input );
-  return parse(is,*this);
+
+Array diff( const Object &from, const Object &to ) {
+    return diff( Value( from ), Value( to ) );
+}
+
+Array diff( const Array &from, const Array &to ) {
+    return diff( Value( from ), Value( to ) );
 }
 
 }  // namespace jsonxx
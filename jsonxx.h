@@ -33,6 +33,18 @@
 #define JSONXX_COMPILER_HAS_CXX11 0
 #endif
 
+#if JSONXX_COMPILER_HAS_CXX11 > 0
+#include <memory>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#define JSONXX_COMPILER_HAS_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#else
+#define JSONXX_COMPILER_HAS_COROUTINES 0
+#endif
+
 #ifdef _MSC_VER
 // disable the C4127 warning if using VC, see http://stackoverflow.com/a/12042515
 #define JSONXX_ASSERT(...) \
@@ -100,16 +112,149 @@ struct identity {
   typedef T type;
 };
 
+// Per-call parser settings. The defaults follow the Settings above.
+struct ParseOptions {
+  ParseOptions()
+    : permissive( Parser == Permissive ),
+      unquoted_keys( UnquotedKeys == Enabled ),
+      comments( Parser == Permissive ),
+      max_depth( 1024 ),
+      utf8( false ),
+      threads( 1 ),
+      min_parallel( 1 << 20 ) {}
+
+  bool permissive;     // trailing commas, single quotes, omitted values, duplicate keys
+  bool unquoted_keys;  // {name: "world"}
+  bool comments;       // C++ style comments: // ...
+  size_t max_depth;    // deeper nesting of objects and arrays fails to parse
+  bool utf8;           // strings must be well-formed UTF-8
+  unsigned threads;    // Array::parse() of a large string on worker threads; 0 = one per core
+  size_t min_parallel; // shorter input (in bytes) is parsed on the calling thread
+};
+
+// Per-call settings for json().
+struct WriteOptions {
+  WriteOptions()
+    : compact( false ),
+      threads( 1 ),
+      min_parallel( 4096 ) {}
+
+  bool compact;         // no indentation or line breaks
+  unsigned threads;     // writer threads for large arrays and objects; 0 = one per core
+  size_t min_parallel;  // smaller arrays and objects are written on the calling thread (64 at least)
+};
+
 // Tools
 bool validate( const std::string &input );
 bool validate( std::istream &input );
+// As above; on failure error_offset receives the byte offset (from the
+// start of the input) at which the document stopped being valid JSON.
+bool validate( const std::string &input, size_t &error_offset, const ParseOptions &options = ParseOptions() );
+bool validate( std::istream &input, size_t &error_offset, const ParseOptions &options = ParseOptions() );
+// True if input is well-formed UTF-8 (RFC 3629); otherwise error_offset
+// receives the offset of the first byte of the bad sequence.
+bool validate_utf8( const std::string &input );
+bool validate_utf8( const std::string &input, size_t &error_offset );
+// Parses input, which must hold an object or an array, and writes it as
+// json() does: members sorted by key, a repeated key once with its last
+// value. Bad input gives an empty string.
 std::string reformat( const std::string &input );
 std::string reformat( std::istream &input );
+// Reformats as it reads, in the layout of json() or compact: memory use is
+// bounded by the nesting depth, not the size of the input. Members keep
+// their input order, repeated keys included. Returns false on bad input.
+bool reformat( std::istream &input, std::ostream &output, bool compact = false, const ParseOptions &options = ParseOptions() );
+// Parses input, which must hold an object or an array, and writes it as
+// xml() does: members sorted by key, a repeated key once with its last
+// value. Bad input gives the empty document of the format.
 std::string xml( const std::string &input, unsigned format = JSONx );
 std::string xml( std::istream &input, unsigned format = JSONx );
+// Converts as it reads: memory use is bounded by the nesting depth, not
+// the size of the input. Members keep their input order, repeated keys
+// included. Returns false on bad input, leaving whatever was written up to
+// that point.
+bool xml( std::istream &input, std::ostream &output, unsigned format = JSONx, const ParseOptions &options = ParseOptions() );
+// Applies an RFC 6902 JSON Patch, an array of operations, in place. Only
+// the containers on the paths the operations name are changed: "move"
+// relinks the value it moves, and the values "add", "replace" and "copy"
+// put in are shared (see Object) rather than copied. Returns false at the
+// first operation that fails, with the document as the operations before
+// it left it; to keep the original, patch a copy, which is cheap.
+bool patch( Value &document, const Array &operations );
+bool patch( Object &document, const Array &operations );
+bool patch( Array &document, const Array &operations );
+// Applies an RFC 7386 JSON Merge Patch in place.
+void merge_patch( Value &document, const Value &patch );
+void merge_patch( Object &document, const Object &patch );
+// The JSON Patch that turns from into to, so that patch( from, diff( from,
+// to ) ) leaves from equal to to. Containers the two share (see Object)
+// are skipped unread; array elements are matched by a hash of their
+// contents, so adding or removing one leaves those after it alone. An
+// element that moves comes out as a remove and an add; there are no
+// "move" or "copy" operations.
+Array diff( const Value &from, const Value &to );
+Array diff( const Object &from, const Object &to );
+Array diff( const Array &from, const Array &to );
+
+// What parse(), validate(), reformat(), json() and xml() did on one thread
+// while a StatsScope was open on it. Reading counts the values and escape
+// sequences of the input; writing those of the document written.
+struct Stats {
+  Stats();
+
+  unsigned long long calls;          // top-level calls counted
+  unsigned long long bytes_read;     // of JSON text
+  unsigned long long bytes_written;  // of JSON or XML text
+  unsigned long long objects, arrays, strings, numbers, booleans, nulls;
+  unsigned long long keys;           // object members
+  unsigned long long escapes_read;   // \n, \uXXXX, ... decoded
+  unsigned long long escapes_written;// bytes written as an escape or entity
+  size_t max_depth;                  // deepest nesting of objects and arrays
+  unsigned long long allocations;    // by the StatsScope counter, if any
+  unsigned long long nanoseconds;    // spent in the calls
+};
+
+// Counts the calls this thread makes into stats for as long as it lives.
+// Scopes nest; the innermost gets the counts. jsonxx cannot see the heap,
+// so allocations are counted only if the program passes a function that
+// returns its running allocation count (from its own operator new, say).
+// With no scope open, the calls cost one thread-local load more.
+class StatsScope {
+ public:
+  explicit StatsScope( Stats &stats, unsigned long long (*allocations)() = 0 );
+  ~StatsScope();
+
+ private:
+  StatsScope( const StatsScope & );
+  StatsScope &operator=( const StatsScope & );
+  Stats *previous_;
+  unsigned long long (*previous_allocations_)();
+};
+
+// Bytes a document holds, by the type of the values holding them: each
+// Value node, and what it points to. Estimates, not allocator figures:
+// std::map nodes count as four pointers plus the member, vectors and
+// strings by capacity (short strings inside the object count nothing
+// more). Containers shared with copies (see Object) count once, and count
+// in shared as well.
+struct MemoryUsage {
+  MemoryUsage();
+  size_t bytes() const;  // in all
+
+  struct Part {
+    size_t count;  // values of the type
+    size_t bytes;
+  };
+  Part objects;   // Object, member nodes and key text
+  Part arrays;    // Array and its vector
+  Part strings;   // String and its text
+  Part numbers, booleans, nulls;
+  size_t shared;  // held jointly with copies
+};
 
 // Detail
 void assertion( const char *file, int line, const char *expression, bool result );
+struct Internal;
 
 // A JSON Object
 class Object {
@@ -133,15 +278,35 @@ class Object {
   size_t size() const;
   bool empty() const;
 
+  // Read only: the values may be shared with copies of this object.
   const std::map<std::string, Value*>& kv_map() const;
+  // As above, but the values are this object's own, so they may be changed
+  // in place, as through get().
+  const std::map<std::string, Value*>& kv_map();
+  // A hash of the contents: equal objects hash alike, whatever order their
+  // members were added in. With cache set, the hashes of this object and
+  // the containers below it are kept and reused until they change. None
+  // is kept for a container holding values that references handed out by
+  // get() may change.
+  size_t hash( bool cache = false ) const;
+  // The bytes this object and its values hold; one pass, no copies.
+  MemoryUsage memory_usage() const;
   std::string json() const;
+  std::string json( const WriteOptions &options ) const;
+  void json( std::ostream &output, const WriteOptions &options = WriteOptions() ) const;
   std::string xml( unsigned format = JSONx, const std::string &header = std::string(), const std::string &attrib = std::string() ) const;
+  // As above, written straight to a stream.
+  void xml( std::ostream &output, unsigned format = JSONx, const std::string &header = std::string(), const std::string &attrib = std::string() ) const;
   std::string write( unsigned format ) const;
 
   void reset();
   bool parse(std::istream &input);
   bool parse(const std::string &input);
+  bool parse(std::istream &input, const ParseOptions &options);
+  bool parse(const std::string &input, const ParseOptions &options);
   typedef std::map<std::string, Value*> container;
+  // Copies share their members until either side changes: copying is
+  // O(1), and a change copies only the values on the path to it.
   void import( const Object &other );
   void import( const std::string &key, const Value &value );
   Object &operator<<(const Value &value);
@@ -150,15 +315,23 @@ class Object {
   Object(const Object &other);
   Object(const std::string &key, const Value &value);
   template<size_t N>
-  Object(const char (&key)[N], const Value &value) {
+  Object(const char (&key)[N], const Value &value) : body_(0), value_map_(none()) {
     import(key,value);
   }
   template<typename T>
   Object &operator<<(const T &value);
 
  protected:
+  friend struct Internal;
   static bool parse(std::istream& input, Object& object);
-  container value_map_;
+  // Members to change, copied first if shared. With leak set they stay
+  // this object's own: references handed out by get() must not reach
+  // later copies.
+  container &unshare( bool leak = false );
+  static const container *none();
+  struct Body;
+  Body *body_;                    // 0 while empty
+  const container *value_map_;    // body_'s members, or none()
   std::string odd;
 };
 
@@ -181,17 +354,33 @@ class Array {
   template <typename T>
   const T& get(unsigned int i, const typename identity<T>::type& default_value) const;
 
+  // Read only: the values may be shared with copies of this array.
   const std::vector<Value*>& values() const {
-    return values_;
+    return *values_;
+  }
+  // See Object::kv_map().
+  const std::vector<Value*>& values() {
+    return unshare( true );
   }
+  // See Object::hash().
+  size_t hash( bool cache = false ) const;
+  // See Object::memory_usage().
+  MemoryUsage memory_usage() const;
   std::string json() const;
+  std::string json( const WriteOptions &options ) const;
+  void json( std::ostream &output, const WriteOptions &options = WriteOptions() ) const;
   std::string xml( unsigned format = JSONx, const std::string &header = std::string(), const std::string &attrib = std::string() ) const;
+  // As above, written straight to a stream.
+  void xml( std::ostream &output, unsigned format = JSONx, const std::string &header = std::string(), const std::string &attrib = std::string() ) const;
 
   std::string write( unsigned format ) const { return format == JSON ? json() : xml(format); }
   void reset();
   bool parse(std::istream &input);
   bool parse(const std::string &input);
+  bool parse(std::istream &input, const ParseOptions &options);
+  bool parse(const std::string &input, const ParseOptions &options);
   typedef std::vector<Value*> container;
+  // Copies share their elements until either side changes, as with Object.
   void append(const Array &other);
   void append(const Value &value) { import(value); }
   void import(const Array &other);
@@ -203,8 +392,14 @@ class Array {
   Array(const Array &other);
   Array(const Value &value);
  protected:
+  friend struct Internal;
   static bool parse(std::istream& input, Array& array);
-  container values_;
+  // See Object::unshare().
+  container &unshare( bool leak = false );
+  static const container *none();
+  struct Body;
+  Body *body_;                    // 0 while empty
+  const container *values_;       // body_'s elements, or none()
 };
 
 // A value could be a number, an array, a string, an object, a
@@ -276,34 +471,8 @@ class Value {
     type_ = OBJECT_;
     *( object_value_ = new Object() ) = o;
   }
-  void import( const Value &other ) {
-    if (this != &other)
-    switch (other.type_) {
-      case NULL_:
-        import( Null() );
-        break;
-      case BOOL_:
-        import( other.bool_value_ );
-        break;
-      case NUMBER_:
-        import( other.number_value_ );
-        break;
-      case STRING_:
-        import( *other.string_value_ );
-        break;
-      case ARRAY_:
-        import( *other.array_value_ );
-        break;
-      case OBJECT_:
-        import( *other.object_value_ );
-        break;
-      case INVALID_:
-        type_ = INVALID_;
-        break;
-      default:
-        JSONXX_ASSERT( !"not implemented" );
-    }
-  }
+  // Arrays and objects are shared with the copy until either changes.
+  void import( const Value &other );
   template<typename T>
   Value &operator <<( const T &t ) {
     import(t);
@@ -316,6 +485,7 @@ class Value {
     return *this;
   }
   Value(const Value &other);
+  Value &operator=(const Value &other);
   template<typename T>
   Value( const T&t ) : type_(INVALID_) { import(t); }
   template<size_t N>
@@ -323,6 +493,8 @@ class Value {
 
   bool parse(std::istream &input);
   bool parse(const std::string &input);
+  bool parse(std::istream &input, const ParseOptions &options);
+  bool parse(const std::string &input, const ParseOptions &options);
 
   template<typename T>
   bool is() const;
@@ -332,6 +504,10 @@ class Value {
   const T& get() const;
 
   bool empty() const;
+  // See Object::hash(). A value holding an array or object hashes as it.
+  size_t hash( bool cache = false ) const;
+  // See Object::memory_usage(); this value's own node included.
+  MemoryUsage memory_usage() const;
 
  public:
   enum {
@@ -355,12 +531,225 @@ protected:
   static bool parse(std::istream& input, Value& value);
 };
 
+// Deep comparison, stopping at the first difference. Numbers compare by
+// value; arrays and objects that share their values (see Object), or
+// whose kept hashes differ, are told apart without being read.
+bool operator==( const Value &a, const Value &b );
+bool operator!=( const Value &a, const Value &b );
+bool operator==( const Object &a, const Object &b );
+bool operator!=( const Object &a, const Object &b );
+bool operator==( const Array &a, const Array &b );
+bool operator!=( const Array &a, const Array &b );
+
+// Parses one document handed over in pieces, as they arrive:
+//
+//   jsonxx::Object o;
+//   jsonxx::PushParser parser( o );
+//   while( receive( buffer, &size ) )
+//     if( !parser.feed( buffer, size ) ) break;  // bad input
+//   if( parser.finish() ) ...                     // o holds the document
+//
+// Pieces may split the input anywhere, even inside a string, an escape or
+// a number; the result is the same as parse() on the whole input. Only an
+// unfinished token is kept between pieces, never the input read so far.
+class PushParser {
+ public:
+  explicit PushParser( Value &target, const ParseOptions &options = ParseOptions() );
+  explicit PushParser( Object &target, const ParseOptions &options = ParseOptions() );
+  explicit PushParser( Array &target, const ParseOptions &options = ParseOptions() );
+  ~PushParser();
+
+  // False once the input is known to be bad.
+  bool feed( const char *data, size_t size );
+  // Ends the input. True if it held a whole document.
+  bool finish();
+  // True once a whole document has been read; what follows it is ignored.
+  bool done() const;
+
+  struct State;
+ private:
+  PushParser( const PushParser & );
+  PushParser &operator=( const PushParser & );
+  State *state_;
+};
+
+#if JSONXX_COMPILER_HAS_CXX11 > 0
+// A document that never changes once made, so any number of threads may
+// read it without locks. Reads look like those of an Object:
+//
+//   jsonxx::Snapshot config = holder.load();
+//   if( config.has<jsonxx::Number>("port") ) ... config.get<jsonxx::Number>("port")
+//
+// Copies are cheap and share the document; it lives as long as the last.
+class Snapshot {
+ public:
+  Snapshot();
+  // Takes a copy of document, which shares its members (see Object).
+  explicit Snapshot( const Object &document );
+
+  template <typename T>
+  bool has( const std::string &key ) const { return root_->has<T>( key ); }
+  template <typename T>
+  const T &get( const std::string &key ) const { return root_->get<T>( key ); }
+  template <typename T>
+  const T &get( const std::string &key, const typename identity<T>::type &default_value ) const {
+    return root_->get<T>( key, default_value );
+  }
+  size_t size() const;
+  bool empty() const;
+  const Object &root() const { return *root_; }
+
+ private:
+  friend class SnapshotHolder;
+  explicit Snapshot( const std::shared_ptr<const Object> &root ) : root_( root ) {}
+  std::shared_ptr<const Object> root_;
+};
+
+// Publishes snapshots, RCU style: readers load() the current one while a
+// writer parses the next off to the side and swaps it in. load() takes no
+// lock and never waits, only a few atomic operations; store() waits for
+// loads already under way to finish, and stores take turns. A reader keeps
+// the snapshot it loaded, consistent, for as long as it holds it; the old
+// one is freed by whoever drops it last.
+class SnapshotHolder {
+ public:
+  SnapshotHolder();
+  explicit SnapshotHolder( const Snapshot &initial );
+  ~SnapshotHolder();
+
+  Snapshot load() const;
+  void store( const Snapshot &next );
+  // Parses input and publishes it. On bad input the current snapshot
+  // stays, and false is returned.
+  bool reload( std::istream &input, const ParseOptions &options = ParseOptions() );
+  bool reload( const std::string &input, const ParseOptions &options = ParseOptions() );
+
+  struct State;
+ private:
+  SnapshotHolder( const SnapshotHolder & );
+  SnapshotHolder &operator=( const SnapshotHolder & );
+  State *state_;
+};
+
+// A bounded cache of parsed documents in front of parse(), for input that
+// repeats. Input is looked up by a fast hash of its bytes, then compared in
+// full, so a hash collision can never return the wrong document. A hit
+// hands out the cached document shared (see Object): O(1), and changing
+// it leaves the cached one alone. Bad input is never cached. The least
+// recently used documents are dropped first. Safe to use from any number
+// of threads: entries are split between shards, each with its own lock,
+// and there are never more shards than capacity.
+class ParseCache {
+ public:
+  explicit ParseCache( size_t capacity, unsigned shards = 16 );
+  ~ParseCache();
+
+  // As Value::parse() and Object::parse().
+  bool parse( const std::string &input, Value &document, const ParseOptions &options = ParseOptions() );
+  bool parse( const std::string &input, Object &document, const ParseOptions &options = ParseOptions() );
+
+  struct Stats {
+    unsigned long long hits, misses, evictions;
+    size_t size;  // documents held
+  };
+  Stats stats() const;
+  void clear();
+
+  struct Shard;
+ private:
+  ParseCache( const ParseCache & );
+  ParseCache &operator=( const ParseCache & );
+  bool lookup( const std::string &input, Value &document, const ParseOptions &options, bool object );
+  Shard *shards_;
+  unsigned count_;
+};
+#endif
+
+#if JSONXX_COMPILER_HAS_COROUTINES
+// A parse running as a coroutine, returned by parse_async(). It starts
+// when first awaited, suspends whenever its source has no bytes ready, and
+// gives true if the input held a whole document:
+//
+//   jsonxx::Object o;
+//   if( co_await jsonxx::parse_async( connection, o ) ) ...
+//
+// Code outside a coroutine may start() it and poll done() instead.
+class AsyncParse {
+ public:
+  struct promise_type {
+    promise_type() : result(false) {}
+    AsyncParse get_return_object() {
+      return AsyncParse( std::coroutine_handle<promise_type>::from_promise( *this ) );
+    }
+    std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+    // hands control straight back to whoever awaited the parse
+    struct Resume {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> self ) noexcept {
+        std::coroutine_handle<> next = self.promise().awaiter;
+        return next ? next : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    Resume final_suspend() noexcept { return Resume(); }
+    void return_value( bool ok ) { result = ok; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    bool result;
+    std::exception_ptr error;
+    std::coroutine_handle<> awaiter;
+  };
+
+  AsyncParse( AsyncParse &&other ) noexcept : handle_( other.handle_ ) { other.handle_ = nullptr; }
+  ~AsyncParse() { if( handle_ ) handle_.destroy(); }
+
+  bool await_ready() const noexcept { return handle_.done(); }
+  std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept {
+    handle_.promise().awaiter = awaiter;
+    return handle_;
+  }
+  bool await_resume() const { return result(); }
+
+  // Runs the parse up to its first suspension.
+  void start() { if( !handle_.done() ) handle_.resume(); }
+  bool done() const { return handle_.done(); }
+  // Whether the input held a whole document; rethrows what the source threw.
+  bool result() const {
+    if( handle_.promise().error ) std::rethrow_exception( handle_.promise().error );
+    return handle_.promise().result;
+  }
+
+ private:
+  explicit AsyncParse( std::coroutine_handle<promise_type> handle ) : handle_( handle ) {}
+  AsyncParse( const AsyncParse & );
+  AsyncParse &operator=( const AsyncParse & );
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Parses what source delivers into target through a PushParser. `co_await
+// source.read()` must give the next piece as something with data() and
+// size(), such as a std::string_view, that stays valid until the next read;
+// an empty piece ends the input. Source and target are held by reference
+// and must outlive the parse.
+template<typename Source, typename Target>
+AsyncParse parse_async( Source &source, Target &target, ParseOptions options = ParseOptions() ) {
+  PushParser parser( target, options );
+  for( ;; ) {
+    auto piece = co_await source.read();
+    if( piece.size() == 0 )
+      co_return parser.finish();
+    if( !parser.feed( piece.data(), piece.size() ) )
+      co_return false;
+  }
+}
+#endif
+
 template <typename T>
 bool Array::has(unsigned int i) const {
   if (i >= size()) {
     return false;
   } else {
-    Value* v = values_.at(i);
+    Value* v = values_->at(i);
     return v->is<T>();
   }
 }
@@ -368,21 +757,21 @@ bool Array::has(unsigned int i) const {
 template <typename T>
 T& Array::get(unsigned int i) {
   JSONXX_ASSERT(i < size());
-  Value* v = values_.at(i);
+  Value* v = unshare(true).at(i);
   return v->get<T>();
 }
 
 template <typename T>
 const T& Array::get(unsigned int i) const {
   JSONXX_ASSERT(i < size());
-  const Value* v = values_.at(i);
+  const Value* v = values_->at(i);
   return v->get<T>();
 }
 
 template <typename T>
 const T& Array::get(unsigned int i, const typename identity<T>::type& default_value) const {
   if(has<T>(i)) {
-    const Value* v = values_.at(i);
+    const Value* v = values_->at(i);
     return v->get<T>();
   } else {
     return default_value;
@@ -391,26 +780,26 @@ const T& Array::get(unsigned int i, const typename identity<T>::type& default_va
 
 template <typename T>
 bool Object::has(const std::string& key) const {
-  container::const_iterator it(value_map_.find(key));
-  return it != value_map_.end() && it->second->is<T>();
+  container::const_iterator it(value_map_->find(key));
+  return it != value_map_->end() && it->second->is<T>();
 }
 
 template <typename T>
 T& Object::get(const std::string& key) {
   JSONXX_ASSERT(has<T>(key));
-  return value_map_.find(key)->second->get<T>();
+  return unshare(true).find(key)->second->get<T>();
 }
 
 template <typename T>
 const T& Object::get(const std::string& key) const {
   JSONXX_ASSERT(has<T>(key));
-  return value_map_.find(key)->second->get<T>();
+  return value_map_->find(key)->second->get<T>();
 }
 
 template <typename T>
 const T& Object::get(const std::string& key, const typename identity<T>::type& default_value) const {
   if (has<T>(key)) {
-    return value_map_.find(key)->second->get<T>();
+    return value_map_->find(key)->second->get<T>();
   } else {
     return default_value;
   }
@@ -0,0 +1,193 @@
+// -*- mode: c++; c-basic-offset: 4; -*-
+
+// Allocation budgets for parsing and writing fixed documents. Replaces the
+// global operator new and delete, so it is a binary of its own; `make test`
+// runs it after jsonxx_test. A change that makes any of these allocate
+// more often, or hold more memory at its peak, fails here. Run with -v to
+// see the figures.
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "jsonxx.h"
+
+// Counts allocations and tracks the bytes live, and their peak, in a
+// header in front of every block. The tests run on one thread.
+namespace {
+const size_t header = 16;
+size_t allocations = 0, live = 0, peak = 0;
+}
+
+void *operator new( size_t size ) {
+    char *block = static_cast<char *>( std::malloc( size + header ) );
+    if( !block )
+        throw std::bad_alloc();
+    *reinterpret_cast<size_t *>( block ) = size;
+    ++allocations;
+    if( ( live += size ) > peak )
+        peak = live;
+    return block + header;
+}
+void *operator new[]( size_t size ) {
+    return operator new( size );
+}
+void operator delete( void *p ) noexcept {
+    if( p ) {
+        char *block = static_cast<char *>( p ) - header;
+        live -= *reinterpret_cast<size_t *>( block );
+        std::free( block );
+    }
+}
+void operator delete[]( void *p ) noexcept {
+    operator delete( p );
+}
+
+namespace {
+
+using namespace jsonxx;
+
+bool verbose = false;
+
+// What fn allocated: how many blocks, the most bytes it held at once, and
+// the bytes still held when it returned.
+struct Usage {
+    size_t allocations, peak;
+    long kept;
+};
+
+template<typename Fn>
+Usage measure( const char *name, Fn fn ) {
+    const size_t allocated = allocations, before = live;
+    peak = live;
+    fn();
+    const Usage usage = { allocations - allocated, peak - before, long( live - before ) };
+    if( verbose )
+        std::printf( "%-32s %8zu allocations %10zu peak bytes %10ld kept\n", name, usage.allocations, usage.peak, usage.kept );
+    return usage;
+}
+
+#define TEST(...) do { if( !( __VA_ARGS__ ) ) { \
+    std::cout << "jsonxx_alloc_test.cc:" << __LINE__ << ": '" #__VA_ARGS__ "' failed" << std::endl; \
+    std::exit( 1 ); } } while(0)
+
+// n records of a few members each, 24 values per record.
+std::string records( size_t n ) {
+    std::string out = "[";
+    char line[256];
+    for( size_t i = 0; i < n; ++i ) {
+        std::snprintf( line, sizeof(line),
+                       "%s{\"id\": %u, \"name\": \"user %u\", \"score\": %u.5, \"active\": true,"
+                       " \"tags\": [\"a\", \"b & c\"], \"address\": {\"city\": \"X<%u>\", \"zip\": null}}",
+                       i ? ", " : "", unsigned(i), unsigned(i), unsigned(i % 100), unsigned(i % 13) );
+        out += line;
+    }
+    return out + "]";
+}
+
+std::string numbers( size_t n ) {
+    std::ostringstream out;
+    out << "[";
+    for( size_t i = 0; i < n; ++i )
+        out << ( i ? "," : "" ) << i * 37 % 1000;
+    out << "]";
+    return out.str();
+}
+
+} // namespace
+
+int main( int argc, const char **argv ) {
+    verbose = argc > 1 && std::string( argv[1] ) == "-v";
+
+    const std::string text = records( 1000 );
+    const std::string list = numbers( 10000 );
+    Usage usage;
+    const size_t baseline = live;
+
+    // Parsing costs about three allocations per value in a record (its
+    // Value, its map or vector node, its key or text) and about one per
+    // number, and holds memory in proportion to the document. Reading from
+    // a stream adds the stream's copy of the input, nothing per value.
+    const size_t values = 11 * 1000;
+    Array parsed;
+    usage = measure( "parse records", [&] { parsed.parse( text ); } );
+    TEST( usage.allocations <= 3 * values + 64 );
+    TEST( usage.peak <= 128 * values );
+    const Usage parse = usage;
+
+    // memory_usage() tells what the document holds, near enough to what
+    // the heap says: within a tenth, the Array itself on the stack aside.
+    const size_t estimate = parsed.memory_usage().bytes() - sizeof(Array);
+    if( verbose )
+        std::printf( "%-32s %8zu bytes estimated\n", "memory_usage records", estimate );
+    TEST( estimate * 10 >= size_t( usage.kept ) * 9 && estimate * 10 <= size_t( usage.kept ) * 11 );
+    usage = measure( "memory_usage records", [&] { parsed.memory_usage(); } );
+    TEST( usage.peak <= 64 * 1024 && usage.kept == 0 );
+    usage = measure( "parse numbers", [&] { Array a; a.parse( list ); } );
+    TEST( usage.allocations <= 10000 + 32 );
+    TEST( usage.peak <= 48 * 10000 && usage.kept == 0 );
+    usage = measure( "parse records, stream", [&] { std::istringstream in( text ); Array a; a.parse( in ); } );
+    TEST( usage.allocations <= parse.allocations + 8 );
+    TEST( usage.peak <= parse.peak + text.size() + 4096 && usage.kept == 0 );
+    usage = measure( "push parse records", [&] {
+        Array a;
+        PushParser parser( a );
+        for( size_t at = 0; at < text.size(); at += 4096 )
+            parser.feed( text.data() + at, std::min<size_t>( 4096, text.size() - at ) );
+        parser.finish();
+    } );
+    TEST( usage.allocations <= parse.allocations + 8 );
+    TEST( usage.peak <= parse.peak + 16384 && usage.kept == 0 );
+
+    // Checking allocates nothing for documents of ordinary depth.
+    usage = measure( "validate records", [&] { validate( text ); } );
+    TEST( usage.allocations == 0 );
+
+    // Writing grows one output buffer, whatever the size of the document,
+    // and holds at most three times the output while it does.
+    std::string out;
+    usage = measure( "json records", [&] { out = parsed.json(); } );
+    TEST( usage.allocations <= 24 );
+    TEST( usage.peak <= 3 * out.size() );
+    WriteOptions compact;
+    compact.compact = true;
+    usage = measure( "json records, compact", [&] { out = parsed.json( compact ); } );
+    TEST( usage.allocations <= 24 );
+    TEST( usage.peak <= 3 * out.size() );
+    static const char *const names[] = { "", "xml records JSONx", "xml records JXML", "xml records JXMLex", "xml records TaggedXML" };
+    for( unsigned format = JSONx; format <= TaggedXML; ++format ) {
+        usage = measure( names[format], [&] { out = parsed.xml( format ); } );
+        TEST( usage.allocations <= 32 );
+        TEST( usage.peak <= 3 * out.size() );
+    }
+    const size_t reformatted = reformat( text ).size();
+    usage = measure( "reformat records, stream", [&] {
+        std::istringstream in( text );
+        std::ostringstream out;
+        reformat( in, out );
+    } );
+    TEST( usage.allocations <= 16 );
+    TEST( usage.peak <= text.size() + 3 * reformatted && usage.kept == 0 );
+
+    // Copies share their members: copying allocates nothing, and a change
+    // below copies the one level above it, two allocations per element.
+    usage = measure( "copy records", [&] { Array copy( parsed ); } );
+    TEST( usage.allocations == 0 );
+    usage = measure( "copy records + change one", [&] {
+        Array copy( parsed );
+        copy.get<Object>(500) << "active" << false;
+    } );
+    TEST( usage.allocations <= 2 * 1000 + 32 );
+    TEST( usage.kept == 0 );
+
+    // Everything comes back.
+    parsed.reset();
+    std::string().swap( out );
+    TEST( live == baseline );
+
+    std::cout << "All allocation budgets ok." << std::endl;
+    return 0;
+}
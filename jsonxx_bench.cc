@@ -0,0 +1,450 @@
+// -*- mode: c++; c-basic-offset: 4; -*-
+
+// Throughput benchmarks for jsonxx. Build and run with `make bench`.
+//
+//   jsonxx_bench [--json] [filter]
+//
+// prints MB/s, ns/op and heap allocations per op for every benchmark
+// whose "section/name" contains filter. --json prints the results as a
+// JSON array instead, for tracking regressions between builds.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "jsonxx.h"
+
+// Every allocation in the process is counted, worker threads included.
+namespace {
+std::atomic<unsigned long long> allocations( 0 );
+}
+
+void *operator new( size_t size ) {
+    allocations.fetch_add( 1, std::memory_order_relaxed );
+    if( void *p = std::malloc( size ? size : 1 ) )
+        return p;
+    throw std::bad_alloc();
+}
+void *operator new[]( size_t size ) {
+    return operator new( size );
+}
+void operator delete( void *p ) noexcept {
+    std::free( p );
+}
+void operator delete[]( void *p ) noexcept {
+    std::free( p );
+}
+
+namespace {
+
+using namespace jsonxx;
+
+typedef std::chrono::steady_clock Clock;
+
+bool json_output = false;
+const char *filter = "";
+std::string section_name;
+bool section_shown;
+Array results;
+volatile double sink;  // keeps results the optimizer would drop
+
+void section( const char *name ) {
+    section_name = name;
+    section_shown = false;
+}
+
+// Runs fn repeatedly for about a quarter of a second and reports the
+// throughput over bytes of input per call.
+template<typename Fn>
+void run( const std::string &name, size_t bytes, Fn fn ) {
+    if( ( section_name + "/" + name ).find( filter ) == std::string::npos )
+        return;
+    size_t iterations = 0;
+    const unsigned long long allocated = allocations.load();
+    const Clock::time_point start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        for( int i = 0; i < 8; ++i, ++iterations )
+            fn();
+        elapsed = Clock::now() - start;
+    } while( elapsed < std::chrono::milliseconds(250) );
+
+    const double seconds = std::chrono::duration<double>( elapsed ).count();
+    const double mbs = bytes * iterations / seconds / 1e6;
+    const double ns = seconds * 1e9 / iterations;
+    const double allocs = double( allocations.load() - allocated ) / iterations;
+    if( !json_output ) {
+        if( !section_shown )
+            std::printf( "# %s\n", section_name.c_str() );
+        section_shown = true;
+        std::printf( "%-28s %10.1f MB/s %12.0f ns/op %12.1f allocs/op\n", name.c_str(), mbs, ns, allocs );
+        return;
+    }
+    Object result;
+    result << "section" << section_name;
+    result << "name" << name;
+    result << "bytes" << bytes;
+    result << "iterations" << iterations;
+    result << "mb_per_s" << mbs;
+    result << "ns_per_op" << ns;
+    result << "allocs_per_op" << allocs;
+    results << result;
+}
+
+// Deterministic pseudo random numbers, the same on every platform.
+struct Random {
+    unsigned long long state;
+    explicit Random( unsigned long long seed ) : state( seed ) {}
+    unsigned operator()( unsigned bound ) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return unsigned( state >> 33 ) % bound;
+    }
+};
+
+// An array of strings full of \u escapes: Cyrillic, CJK and surrogate
+// pair emoji, with a little ASCII in between.
+std::string escaped_corpus( size_t strings ) {
+    static const char *const pieces[] = {
+        "\\u041f\\u0440\\u0438\\u0432\\u0435\\u0442",  // Привет
+        "\\u4f60\\u597d\\u4e16\\u754c",                // 你好世界
+        "\\ud83d\\ude00\\ud83c\\udf89",                // 😀🎉
+        "plain text ",
+    };
+    std::string out = "[";
+    for( size_t i = 0; i < strings; ++i ) {
+        out += i ? ",\"" : "\"";
+        for( int j = 0; j < 8; ++j )
+            out += pieces[ (i + j) % 4 ];
+        out += "\"";
+    }
+    return out + "]";
+}
+
+// The same text as raw UTF-8 bytes.
+std::string raw_corpus( size_t strings ) {
+    static const char *const pieces[] = {
+        "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+        "\xe4\xbd\xa0\xe5\xa5\xbd\xe4\xb8\x96\xe7\x95\x8c",
+        "\xf0\x9f\x98\x80\xf0\x9f\x8e\x89",
+        "plain text ",
+    };
+    std::string out = "[";
+    for( size_t i = 0; i < strings; ++i ) {
+        out += i ? ",\"" : "\"";
+        for( int j = 0; j < 8; ++j )
+            out += pieces[ (i + j) % 4 ];
+        out += "\"";
+    }
+    return out + "]";
+}
+
+// Long strings, mostly clean text with an occasional quote or newline.
+std::string long_text( size_t size ) {
+    std::string out;
+    for( size_t i = 0; out.size() < size; ++i )
+        out += i % 16 ? "The quick brown fox jumps over the lazy dog. " : "\"Quoted\"\n";
+    return out;
+}
+
+// Records of mixed values, as a typical API payload.
+std::string records_corpus( size_t records ) {
+    std::string out = "[";
+    char line[256];
+    for( size_t i = 0; i < records; ++i ) {
+        std::snprintf( line, sizeof(line),
+                       "%s{\"id\": %u, \"name\": \"user %u\", \"score\": %u.%02u, \"active\": %s,"
+                       " \"tags\": [\"a\", \"b & c\"], \"address\": {\"city\": \"X<%u>\", \"zip\": null}}",
+                       i ? ", " : "", unsigned(i), unsigned(i * 7), unsigned(i % 100), unsigned(i % 97),
+                       i % 3 ? "true" : "false", unsigned(i % 13) );
+        out += line;
+    }
+    return out + "]";
+}
+
+// Both of the above, one after the other in one array.
+std::string unicode_corpus( size_t strings ) {
+    const std::string escaped = escaped_corpus( strings / 2 );
+    return escaped.substr( 0, escaped.size() - 1 ) + "," + raw_corpus( strings - strings / 2 ).substr( 1 );
+}
+
+// A search API response: statuses with a nested user, entities and
+// mixed text, shaped like the public twitter.json sample.
+std::string twitter_corpus( size_t statuses ) {
+    static const char *const words[] = {
+        "the", "release", "is", "out", "\\u3053\\u3093\\u306b\\u3061\\u306f", "caf\xc3\xa9", "\\\"quoted\\\"",
+        "https:\\/\\/t.co\\/x1", "#jsonxx", "@someone", "\xf0\x9f\x98\x80", "line\\nbreak",
+    };
+    Random random( 1 );
+    std::string out = "{\"statuses\": [";
+    char line[512];
+    for( size_t i = 0; i < statuses; ++i ) {
+        std::string text;
+        for( unsigned n = 4 + random( 16 ); n; --n )
+            ( text += words[ random( 12 ) ] ) += n > 1 ? " " : "";
+        const unsigned user = random( 100000 );
+        std::snprintf( line, sizeof(line),
+                       "%s{\"created_at\": \"Sun Aug 31 00:%02u:%02u +0000 2014\", \"id\": %u%06u,"
+                       " \"id_str\": \"%u%06u\", \"text\": \"", i ? ", " : "",
+                       random( 60 ), random( 60 ), 505874924u + unsigned( i ), random( 1000000 ),
+                       505874924u + unsigned( i ), random( 1000000 ) );
+        ( out += line ) += text;
+        std::snprintf( line, sizeof(line),
+                       "\", \"truncated\": false, \"in_reply_to_status_id\": null,"
+                       " \"user\": {\"id\": %u, \"name\": \"User %u\", \"screen_name\": \"user_%u\","
+                       " \"location\": \"\", \"followers_count\": %u, \"verified\": %s,"
+                       " \"profile_background_color\": \"C0DEED\", \"lang\": \"ja\"},"
+                       " \"geo\": null, \"coordinates\": null, \"retweet_count\": %u, \"favorite_count\": %u,"
+                       " \"entities\": {\"hashtags\": [{\"text\": \"jsonxx\", \"indices\": [%u, %u]}],"
+                       " \"urls\": [], \"user_mentions\": []}, \"favorited\": false, \"lang\": \"ja\"}",
+                       user, user, user, random( 5000 ), random( 2 ) ? "true" : "false",
+                       random( 100 ), random( 100 ), random( 40 ), 40 + random( 40 ) );
+        out += line;
+    }
+    return out + "], \"search_metadata\": {\"count\": 100, \"max_id_str\": \"505874924095815681\"}}";
+}
+
+// Integers, decimals and exponents, as sensor or geometry data.
+std::string numbers_corpus( size_t numbers ) {
+    Random random( 2 );
+    std::string out = "[";
+    char number[64];
+    for( size_t i = 0; i < numbers; ++i ) {
+        switch( random( 3 ) ) {
+        case 0: std::snprintf( number, sizeof(number), "%d", int( random( 2000000 ) ) - 1000000 ); break;
+        case 1: std::snprintf( number, sizeof(number), "%u.%06u", random( 1000 ), random( 1000000 ) ); break;
+        default: std::snprintf( number, sizeof(number), "-%u.%03ue%d", random( 10 ), random( 1000 ), int( random( 40 ) ) - 20 ); break;
+        }
+        ( out += i ? "," : "" ) += number;
+    }
+    return out + "]";
+}
+
+// Many small documents nested depth levels deep, objects and arrays in
+// turn.
+std::string nested_corpus( size_t documents, size_t depth ) {
+    std::string one;
+    for( size_t level = 0; level < depth; ++level )
+        one += level % 2 ? "[1, " : "{\"k\": ";
+    one += "true";
+    for( size_t level = depth; level-- > 0; )
+        one += level % 2 ? "]" : "}";
+    std::string out = "[";
+    for( size_t i = 0; i < documents; ++i )
+        ( out += i ? ", " : "" ) += one;
+    return out + "]";
+}
+
+// Objects whose values are long strings, a few escapes in each.
+std::string strings_corpus( size_t strings ) {
+    Random random( 3 );
+    std::string out = "{";
+    char key[32];
+    for( size_t i = 0; i < strings; ++i ) {
+        std::snprintf( key, sizeof(key), "%s\"field_%u\": \"", i ? ", " : "", unsigned( i ) );
+        out += key;
+        for( unsigned n = 8 + random( 24 ); n; --n )
+            out += random( 8 ) ? "Lorem ipsum dolor sit amet, consectetur adipiscing elit. " : "tab\\tquote\\\"slash\\\\ ";
+        out += "\"";
+    }
+    return out + "}";
+}
+
+// The corpora parse to an object or an array.
+std::string json( const Value &document, const WriteOptions &options ) {
+    return document.is<Object>() ? document.get<Object>().json( options ) : document.get<Array>().json( options );
+}
+std::string xml( const Value &document, unsigned format ) {
+    return document.is<Object>() ? document.get<Object>().xml( format ) : document.get<Array>().xml( format );
+}
+
+} // namespace
+
+int main( int argc, char **argv ) {
+    for( int i = 1; i < argc; ++i ) {
+        if( !std::strcmp( argv[i], "--json" ) )
+            json_output = true;
+        else
+            filter = argv[i];
+    }
+
+    struct Corpus { const char *name; std::string text; };
+    const Corpus corpora[] = {
+        { "twitter", twitter_corpus( 2000 ) },
+        { "numbers", numbers_corpus( 100000 ) },
+        { "nested", nested_corpus( 500, 256 ) },
+        { "string-heavy", strings_corpus( 2000 ) },
+        { "unicode-heavy", unicode_corpus( 5000 ) },
+    };
+    const char *const formats[] = { "", "JSONx", "JXML", "JXMLex", "TaggedXML" };
+    WriteOptions compact;
+    compact.compact = true;
+    for( size_t c = 0; c < sizeof(corpora) / sizeof(*corpora); ++c ) {
+        const std::string &text = corpora[c].text;
+        Value parsed;
+        if( !parsed.parse( text ) ) {
+            std::fprintf( stderr, "corpus %s does not parse\n", corpora[c].name );
+            return 1;
+        }
+        section( corpora[c].name );
+        run( "parse", text.size(), [&] { Value v; v.parse( text ); } );
+        run( "validate", text.size(), [&] { validate( text ); } );
+        run( "json", text.size(), [&] { json( parsed, WriteOptions() ); } );
+        run( "json compact", text.size(), [&] { json( parsed, compact ); } );
+        for( unsigned format = JSONx; format <= TaggedXML; ++format )
+            run( std::string( "xml " ) + formats[format], text.size(), [&] { xml( parsed, format ); } );
+        run( "reformat", text.size(), [&] { reformat( text ); } );
+        run( "reformat compact, streaming", text.size(), [&] {
+            std::istringstream in( text );
+            std::ostringstream out;
+            reformat( in, out, true );
+        } );
+    }
+
+    Object twitter;
+    twitter.parse( corpora[0].text );
+    const Object &timeline = twitter;
+    const Array &statuses = timeline.get<Array>("statuses");
+    section( "lookups" );
+    run( "get nested string", 0, [&] {
+        size_t length = 0;
+        for( size_t i = 0; i < statuses.size(); ++i )
+            length += statuses.get<Object>(i).get<Object>("user").get<String>("screen_name").size();
+        sink = length;
+    } );
+    run( "has, present and missing", 0, [&] {
+        size_t found = 0;
+        for( size_t i = 0; i < statuses.size(); ++i )
+            found += statuses.get<Object>(i).has<Number>("retweet_count") + statuses.get<Object>(i).has<Number>("missing");
+        sink = found;
+    } );
+    run( "get with default", 0, [&] {
+        double sum = 0;
+        for( size_t i = 0; i < statuses.size(); ++i )
+            sum += statuses.get<Object>(i).get<Number>("reply_count", 1);
+        sink = sum;
+    } );
+    const std::string escaped = escaped_corpus( 20000 );
+    const std::string raw = raw_corpus( 20000 );
+    const std::string ascii( 1 << 20, 'x' );
+
+    ParseOptions utf8;
+    utf8.utf8 = true;
+
+    section( "strings" );
+    run( "parse escaped", escaped.size(), [&] { Array a; a.parse( escaped ); } );
+    run( "parse raw", raw.size(), [&] { Array a; a.parse( raw ); } );
+    run( "parse raw, utf8 checked", raw.size(), [&] { Array a; a.parse( raw, utf8 ); } );
+    run( "validate raw", raw.size(), [&] { validate( raw ); } );
+    size_t offset;
+    run( "validate raw, utf8 checked", raw.size(), [&] { validate( raw, offset, utf8 ); } );
+    run( "validate_utf8 raw", raw.size(), [&] { validate_utf8( raw ); } );
+    run( "validate_utf8 ascii", ascii.size(), [&] { validate_utf8( ascii ); } );
+
+    Array texts;
+    for( int i = 0; i < 16; ++i )
+        texts << long_text( 64 * 1024 );
+    const size_t text_bytes = 16 * texts.get<String>(0).size();
+
+    section( "escaping" );
+    run( "json long strings", text_bytes, [&] { texts.json(); } );
+    run( "operator<< long strings", text_bytes, [&] { std::ostringstream out; out << texts; } );
+    run( "xml long strings", text_bytes, [&] { texts.xml( JSONx ); } );
+
+    const std::string records = records_corpus( 20000 );
+    Array document;
+    document.parse( records );
+
+    section( "xml" );
+    const char *const names[] = { "", "xml JSONx", "xml JXML", "xml JXMLex", "xml TaggedXML" };
+    for( unsigned format = JSONx; format <= TaggedXML; ++format )
+        run( names[format], records.size(), [&] { document.xml( format ); } );
+    run( "xml JSONx to stream", records.size(), [&] { std::ostringstream out; document.xml( out, JSONx ); } );
+    run( "parse + xml JSONx", records.size(), [&] { Array a; a.parse( records ); a.xml( JSONx ); } );
+    run( "convert JSONx, streaming", records.size(), [&] {
+        std::istringstream in( records );
+        std::ostringstream out;
+        xml( in, out, JSONx );
+    } );
+
+    section( "json" );
+    run( "json", records.size(), [&] { document.json(); } );
+    run( "parse + json", records.size(), [&] { Array a; a.parse( records ); a.json(); } );
+    run( "reformat, streaming", records.size(), [&] {
+        std::istringstream in( records );
+        std::ostringstream out;
+        reformat( in, out );
+    } );
+    const std::string big_records = records_corpus( 200000 );
+    Array big;
+    big.parse( big_records );
+    WriteOptions parallel;
+    parallel.threads = 0;
+    ParseOptions parallel_parse;
+    parallel_parse.threads = 0;
+    run( "parse 200k records", big_records.size(), [&] { Array a; a.parse( big_records ); } );
+    run( "parse 200k records, parallel", big_records.size(), [&] { Array a; a.parse( big_records, parallel_parse ); } );
+    run( "push parse 200k, 16k pieces", big_records.size(), [&] {
+        Array a;
+        PushParser parser( a );
+        for( size_t at = 0; at < big_records.size(); at += 16384 )
+            parser.feed( big_records.data() + at, std::min<size_t>( 16384, big_records.size() - at ) );
+        parser.finish();
+    } );
+    run( "json 200k records", big_records.size(), [&] { big.json(); } );
+    run( "json 200k records, parallel", big_records.size(), [&] { big.json( parallel ); } );
+    run( "reformat compact, streaming", records.size(), [&] {
+        std::istringstream in( records );
+        std::ostringstream out;
+        reformat( in, out, true );
+    } );
+
+    Object config;
+    config << "records" << document;
+    config << "server" << Object( "port", 80 );
+    section( "copies" );
+    run( "copy document", records.size(), [&] { Object copy( config ); } );
+    run( "copy + change two fields", records.size(), [&] {
+        Object copy( config );
+        copy.get<Object>("server") << "port" << 8080;
+        copy.get<Array>("records").get<Object>(7) << "active" << true;
+    } );
+    Object changed( config );
+    changed.get<Array>("records").get<Object>(7) << "active" << true;
+    run( "diff, one change", records.size(), [&] { diff( config, changed ); } );
+    Array reparsed;
+    reparsed.parse( records );
+    run( "diff, equal, nothing shared", records.size(), [&] { diff( document, reparsed ); } );
+    run( "==, equal, nothing shared", records.size(), [&] { (void)( document == reparsed ); } );
+    run( "memory_usage", records.size(), [&] { reparsed.memory_usage(); } );
+    run( "hash", records.size(), [&] { reparsed.hash(); } );
+    reparsed.hash( true );
+    run( "hash, kept", records.size(), [&] { reparsed.hash(); } );
+
+    section( "cache" );
+    ParseCache cache( 16 );
+    run( "parse records", records.size(), [&] { Array a; a.parse( records ); } );
+    run( "cache hit records", records.size(), [&] { Value v; cache.parse( records, v ); } );
+    section( "stats" );
+    run( "parse records, no scope", records.size(), [&] { Array a; a.parse( records ); } );
+    run( "parse records, counted", records.size(), [&] {
+        Stats stats;
+        StatsScope scope( stats );
+        Array a;
+        a.parse( records );
+    } );
+    run( "json records, counted", records.size(), [&] {
+        Stats stats;
+        StatsScope scope( stats );
+        document.json();
+    } );
+
+    if( json_output )
+        std::printf( "%s\n", results.json().c_str() );
+    return 0;
+}
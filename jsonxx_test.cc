@@ -9,9 +9,67 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "jsonxx.h"
 
+#if JSONXX_COMPILER_HAS_COROUTINES
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+
+// A single threaded event loop and a source on it that hands out its text
+// in fragments of random size, one per turn, the way a socket would.
+struct Loop {
+    std::deque<std::coroutine_handle<> > ready;
+    void run() {
+        while( !ready.empty() ) {
+            std::coroutine_handle<> next = ready.front();
+            ready.pop_front();
+            next.resume();
+        }
+    }
+};
+
+struct Fragments {
+    Fragments( Loop &loop, const std::string &text, unsigned seed ) : loop( loop ), text( text ), at( 0 ), random( seed ) {}
+
+    struct Read {
+        Fragments &source;
+        bool await_ready() const { return false; }
+        void await_suspend( std::coroutine_handle<> parse ) { source.loop.ready.push_back( parse ); }
+        std::string_view await_resume() {
+            if( source.at > source.text.size() )
+                throw std::runtime_error( "read past the end" );
+            size_t size = std::min<size_t>( source.random() % 16, source.text.size() - source.at );
+            if( size == 0 && source.at < source.text.size() )
+                size = 1;
+            std::string_view piece( source.text.data() + source.at, size );
+            source.at += size ? size : 1;
+            return piece;
+        }
+    };
+    Read read() { return Read{ *this }; }
+
+    Loop &loop;
+    std::string text;
+    size_t at;
+    std::mt19937 random;
+};
+
+// Awaits two parses in turn, as a handler on the loop would.
+jsonxx::AsyncParse parse_both( Fragments &a, jsonxx::Object &x, Fragments &b, jsonxx::Array &y ) {
+    bool first = co_await jsonxx::parse_async( a, x );
+    bool second = co_await jsonxx::parse_async( b, y );
+    co_return first && second;
+}
+#endif
+
 namespace jsonxx {
     extern bool parse_string(std::istream& input, String& value);
     extern bool parse_number(std::istream& input, Number& value);
@@ -26,6 +84,12 @@ bool is_asserting() {
 
 struct custom_type {};      // Used in a test elsewhere
 
+// A stand-in for a program's allocation counter: one more each call.
+unsigned long long ticks() {
+    static unsigned long long count = 0;
+    return count++;
+}
+
 int main(int argc, const char **argv) {
 
     if( !is_asserting() ) {
@@ -649,6 +713,1088 @@ int main(int argc, const char **argv) {
         TEST( obj.get<String>("test_6") == "defbanana" );
     }
 
+    {
+        // validate() reports where the input stopped being valid JSON
+        size_t offset = 0;
+        TEST( validate( "{\"a\": [1, 2, {\"b\": null}]}", offset ) );
+        TEST( !validate( "{\"a\": [1, 2}", offset ) && offset == 11 );
+        TEST( !validate( "[1, 2] 3", offset ) && offset == 7 );
+        istringstream input( "  [\"x\" : 1]" );
+        TEST( !validate( input, offset ) && offset == 7 );
+
+        string deep = string( 1000, '[' ) + string( 1000, ']' );
+        TEST( validate( deep ) );
+        deep = string( 100000, '[' ) + string( 100000, ']' );
+        TEST( !validate( deep ) );
+    }
+
+    {
+        // values are read back to back from one stream, no rollback needed
+        istringstream input( " 1.5e2 [2] {\"k\": \"v\"} false" );
+        Value v;
+        TEST( v.parse(input) && v.is<Number>() && v.get<Number>() == 150 );
+        TEST( v.parse(input) && v.is<Array>() && v.get<Array>().size() == 1 );
+        TEST( v.parse(input) && v.is<Object>() && v.get<Object>().has<String>("k") );
+        TEST( v.parse(input) && v.is<Boolean>() && !v.get<Boolean>() );
+        TEST( !v.parse(input) );
+        TEST( !v.parse("]") );
+        TEST( !v.parse("[1, 2") );
+        TEST( !v.parse("{\"a\" 1}") );
+        TEST( !v.parse("nul") );
+    }
+
+    {
+        // parser settings chosen per call
+        ParseOptions strict, permissive, unquoted;
+        strict.permissive = strict.comments = false;
+        permissive.permissive = permissive.comments = true;
+        unquoted.unquoted_keys = true;
+
+        Object o;
+        TEST( o.parse( "{'a': [1, 2,],} // done", permissive ) );
+        TEST( o.get<Array>("a").size() == 2 );
+        TEST( !o.parse( "{\"a\": [1, 2,]}", strict ) );
+        TEST( !o.parse( "{'a': 1}", strict ) );
+        TEST( o.parse( "{a: 1, b_2: \"x\"}", unquoted ) && o.has<String>("b_2") );
+
+        size_t offset;
+        TEST( !validate( "[1] // done", offset, strict ) && offset == 4 );
+        TEST( validate( "[1] // done", offset, permissive ) );
+        TEST( validate( "{a: 1}", offset, unquoted ) );
+    }
+
+    {
+        // nesting is limited by ParseOptions::max_depth, not by the stack
+        string deep = string( 100000, '[' ) + string( 100000, ']' );
+        Array a;
+        TEST( !a.parse( deep ) );
+
+        ParseOptions options;
+        options.max_depth = 200;
+        TEST( !a.parse( string( 201, '[' ) + string( 201, ']' ), options ) );
+        TEST( a.parse( string( 200, '[' ) + string( 200, ']' ), options ) );
+
+        Object o;
+        TEST( o.parse( "{\"a\": [1, {\"b\": [], \"c\": {}}], \"d\": \"e\"}" ) );
+        TEST( o.get<Array>("a").get<Number>(0) == 1 );
+        TEST( o.get<Array>("a").get<Object>(1).has<Array>("b") );
+        TEST( o.get<Array>("a").get<Object>(1).has<Object>("c") );
+        TEST( o.get<String>("d") == "e" );
+        TEST( !o.parse( "[1]" ) );
+    }
+
+    {
+        // very deep documents are copied and destroyed without recursion
+        const size_t depth = 200000;
+        string deep;
+        for( size_t i = 0; i < depth; ++i )
+            deep += i % 2 ? "{\"k\":" : "[";
+        deep += "\"leaf\"";
+        for( size_t i = depth; i-- > 0; )
+            deep += i % 2 ? "}" : "]";
+
+        ParseOptions options;
+        options.max_depth = depth;
+        Value v;
+        TEST( v.parse( deep, options ) );
+
+        Value copy( v );
+        v.reset();
+        const Value *node = &copy;
+        size_t levels = 0;
+        for( ;; ++levels ) {
+            if( node->is<Array>() )
+                node = node->get<Array>().values()[0];
+            else if( node->is<Object>() )
+                node = node->get<Object>().kv_map().find("k")->second;
+            else
+                break;
+        }
+        TEST( levels == depth && node->get<String>() == "leaf" );
+
+        Array a;
+        a << copy;
+        a << Array( a );
+        TEST( a.size() == 2 );
+    }
+
+    {
+        // \u escapes decode to UTF-8, surrogate pairs included
+        Array a;
+        TEST( a.parse( "[\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\"]" ) );
+        TEST( a.get<String>(0) == "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80" );
+        TEST( a.parse( "[\"\\ud83dx\", \"\\ude00\", \"\\ud83d\\ud83d\\ude00\"]" ) );
+        TEST( a.get<String>(0) == "\xef\xbf\xbdx" );
+        TEST( a.get<String>(1) == "\xef\xbf\xbd" );
+        TEST( a.get<String>(2) == "\xef\xbf\xbd\xf0\x9f\x98\x80" );
+        TEST( a.parse( "[\"\\u0000z\"]" ) && a.get<String>(0) == string( "\0z", 2 ) );
+        TEST( !a.parse( "[\"\\u12g4\"]" ) );
+        TEST( !a.parse( "[\"\\u12" ) );
+
+        // raw bytes are checked only on request
+        ParseOptions options;
+        options.utf8 = true;
+        size_t offset = 0;
+        TEST( a.parse( "[\"\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5\"]", options ) );
+        TEST( a.parse( "[\"caf\xe9\"]" ) );
+        TEST( !a.parse( "[\"caf\xe9\"]", options ) );
+        TEST( !a.parse( "{\"\xc0\xaf\": 1}", options ) );
+        TEST( validate( "[\"\xed\xa0\x80\"]" ) );
+        TEST( !validate( "[\"\xed\xa0\x80\"]", offset, options ) );
+        TEST( !validate( "[\"\xf4\x90\x80\x80\"]", offset, options ) );
+        TEST( validate( "[\"\xf4\x8f\xbf\xbf\"]", offset, options ) );
+
+        TEST( validate_utf8( "plain ascii, long enough to take the wide path" ) );
+        TEST( !validate_utf8( "0123456789abcdef0123\xe2\x82", offset ) && offset == 20 );
+        TEST( !validate_utf8( "0123456789abcdef0123\xff", offset ) && offset == 20 );
+        TEST( !validate_utf8( "\xe0\x80\x80", offset ) && offset == 0 );
+    }
+
+    {
+        // escaping is the same on either side of the wide scan
+        string text;
+        for( int i = 0; i < 100; ++i )
+            text += string( i % 37, 'x' ) + char( i % 32 ) + "\"/\\\xc3\xa9";
+        Array a;
+        a << text;
+        Array b;
+        TEST( b.parse( a.json() ) && b.get<String>(0) == text );
+        ostringstream stream;
+        stream << a;
+        TEST( b.parse( stream.str() ) && b.get<String>(0) == text );
+
+        Value v( string( "tab\there \x01 \xc3\xa9" ) );
+        ostringstream out;
+        out << v;
+        TEST( out.str() == "\"tab\\there \\u0001 \xc3\xa9\"" );
+    }
+
+    {
+        // every XML format escapes text the same way, whichever runs first
+        Array a;
+        a << "a<b & c>d";
+        const unsigned formats[] = { TaggedXML, JXMLex, JXML, JSONx };
+        for( int i = 0; i < 4; ++i )
+            TEST( a.xml( formats[i] ).find( "a&lt;b &amp; c&gt;d" ) != string::npos );
+        Object o;
+        o << "key name!" << "v";
+        TEST( o.xml( TaggedXML ).find( "<key_name_ type=" ) != string::npos );
+    }
+
+    {
+        // xml() straight to a stream matches the string, at any depth
+        Object o;
+        TEST( o.parse( "{\"a\": [1, \"two\", {\"b\": null}], \"c\": true}" ) );
+        for( unsigned format = JSONx; format <= TaggedXML; ++format ) {
+            ostringstream out;
+            o.xml( out, format );
+            TEST( out.str() == o.xml( format ) );
+        }
+        ostringstream out;
+        o.xml( out, JXML, "<?xml?>", " x=\"1\"" );
+        TEST( out.str() == "<?xml?><j son=\"o\" x=\"1\">\n"
+                           "\t<j son=\"a:a\">\n"
+                           "\t\t<j son=\"n\">1</j>\n"
+                           "\t\t<j son=\"s\">two</j>\n"
+                           "\t\t<j son=\"o\">\n"
+                           "\t\t\t<j son=\"0:b\" />\n"
+                           "\t\t</j>\n"
+                           "\t</j>\n"
+                           "\t<j son=\"b:c\">true</j>\n"
+                           "</j>\n" );
+    }
+
+    {
+        // JSON text converts to XML without a document in between
+        const string text = "{\"a\": [1.5, \"x<y\", {\"b\": null}], \"c\": true, \"d\": {}}";
+        Object o;
+        TEST( o.parse( text ) );
+        for( unsigned format = JSONx; format <= TaggedXML; ++format ) {
+            istringstream in( text );
+            ostringstream out;
+            TEST( jsonxx::xml( in, out, format ) );
+            TEST( out.str() == o.xml( format ) );
+            TEST( jsonxx::xml( text, format ) == o.xml( format ) );
+        }
+
+        // members are written in input order, a repeated key as often as
+        // it appears; converting from a string builds the document, so
+        // members come out sorted and once
+        istringstream in( "{\"z\": 1, \"a\": 2, \"z\": 3}" );
+        ostringstream out;
+        TEST( jsonxx::xml( in, out, JXML ) );
+        TEST( out.str().find( "n:z" ) < out.str().find( "n:a" ) && out.str().rfind( "n:z" ) > out.str().find( "n:a" ) );
+        const string sorted = jsonxx::xml( "{\"z\": 1, \"a\": 2, \"z\": 3}", JXML );
+        TEST( sorted.find( "n:a" ) < sorted.find( "n:z" ) && sorted.find( "n:z" ) == sorted.rfind( "n:z" ) );
+        TEST( sorted.find( ">3<" ) != string::npos && sorted.find( ">1<" ) == string::npos );
+
+        istringstream bad( "{\"z\": 1, \"a\": }" );
+        ostringstream partial;
+        TEST( !jsonxx::xml( bad, partial, JXML ) );
+        TEST( jsonxx::xml( "{\"z\": 1, \"a\": }", JXML ).find( "<j" ) == string::npos );
+    }
+
+    {
+        // reformat() streams in the layout of json(), or compact
+        const string text = "{\"a\": [1.5, \"x\\n\", {\"\": [], \"b\": null}], \"c\": true, \"d\": {}}";
+        Object o;
+        TEST( o.parse( text ) );
+        TEST( reformat( text ) == o.json() );
+        TEST( o.json() == "{\n"
+                          "\t\"a\": [\n"
+                          "\t\t1.5,\n"
+                          "\t\t\"x\\n\",\n"
+                          "\t\t{\n"
+                          "\t\t\t\"\": [\n"
+                          "\t\t\t],\n"
+                          "\t\t\t\"b\": null \n"
+                          "\t\t} \n"
+                          "\t],\n"
+                          "\t\"c\": true,\n"
+                          "\t\"d\": {\n"
+                          "\t} \n"
+                          "} \n" );
+        Object round;
+        TEST( round.parse( o.json() ) && round.json() == o.json() );
+
+        istringstream in( text );
+        ostringstream out;
+        TEST( reformat( in, out, true ) );
+        TEST( out.str() == "{\"a\":[1.5,\"x\\n\",{\"\":[],\"b\":null}],\"c\":true,\"d\":{}}" );
+
+        // streamed members keep their input order, repeated keys too;
+        // reformatting a string builds the document, as it always did
+        istringstream repeated( "{\"z\": 1, \"a\": 2, \"a\": 3}" );
+        ostringstream streamed;
+        TEST( reformat( repeated, streamed, true ) && streamed.str() == "{\"z\":1,\"a\":2,\"a\":3}" );
+        TEST( reformat( "{\"z\": 1, \"a\": 2, \"a\": 3}" ) == "{\n\t\"a\": 3,\n\t\"z\": 1 \n} \n" );
+        TEST( reformat( "{\"a\": 1, \"a\": 2}" ) == "{\n\t\"a\": 2 \n} \n" && reformat( "1" ).empty() );
+
+        istringstream bad( "[1, 2" );
+        ostringstream partial;
+        TEST( !reformat( bad, partial ) );
+        TEST( reformat( "[1, 2" ).empty() );
+    }
+
+    {
+        // json() on worker threads matches the single threaded output
+        Array records;
+        for( int i = 0; i < 5000; ++i ) {
+            Object record;
+            record << "id" << i;
+            record << "name" << "record \"" + std::to_string( i ) + "\"";
+            record << "tags" << ( Array() << "a" << i % 7 );
+            records << record;
+        }
+        Object wide;
+        for( int i = 0; i < 3000; ++i )
+            wide << "key " + std::to_string( i ) << ( i % 2 ? Value( i ) : Value( Object( "k", Array() ) ) );
+        Object o;
+        o << "count" << 5000;
+        o << "records" << records;
+        o << "wide" << wide;
+        o << "empty" << Array();
+
+        WriteOptions options;
+        options.threads = 4;
+        options.min_parallel = 100;
+        TEST( o.json( options ) == o.json() );
+        TEST( records.json( options ) == records.json() );
+        options.threads = 0;
+        TEST( wide.json( options ) == wide.json() );
+
+        options.compact = true;
+        ostringstream parallel;
+        o.json( parallel, options );
+        options.threads = 1;
+        ostringstream serial;
+        o.json( serial, options );
+        TEST( parallel.str() == serial.str() );
+        Object round;
+        TEST( round.parse( parallel.str() ) && round.json() == o.json() );
+
+        // large containers are found below small ones, however deep
+        Object result, nested;
+        result << "items" << records;
+        nested << "result" << result;
+        options.threads = 4;
+        options.compact = false;
+        TEST( nested.json( options ) == nested.json() );
+        Array chain;
+        TEST( chain.parse( string( 50000, '[' ) + records.json() + string( 50000, ']' ) ) == false );
+        ParseOptions deeper;
+        deeper.max_depth = 200000;
+        TEST( chain.parse( string( 50000, '[' ) + records.json() + string( 50000, ']' ), deeper ) );
+        options.compact = true;
+        WriteOptions serial_compact;
+        serial_compact.compact = true;
+        TEST( chain.json( options ) == chain.json( serial_compact ) );
+    }
+
+    {
+        // a large top-level array parses on worker threads to the same
+        // elements; anything unusual falls back to the serial parser
+        string text = "[";
+        for( int i = 0; i < 3000; ++i ) {
+            text += i ? ", " : " ";
+            text += "{\"id\": " + std::to_string( i ) + ", \"s\": \"a, [b] {c} \\\" \\\\\", \"n\": [[], {}, [1, [2]]]}";
+        }
+        text += " ] trailing text is ignored, as ever";
+
+        ParseOptions serial;
+        ParseOptions parallel;
+        parallel.threads = 4;
+        parallel.min_parallel = 0;
+        Array a, b;
+        TEST( a.parse( text, serial ) );
+        TEST( b.parse( text, parallel ) );
+        TEST( a.size() == 3000 && b.json() == a.json() );
+
+        TEST( b.parse( "[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]", parallel ) && b.size() == 12 );
+        TEST( b.get<Number>(11) == 12 );
+        TEST( !b.parse( "[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12", parallel ) );
+        TEST( !b.parse( "[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}", parallel ) );
+        TEST( !b.parse( "[\"1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]\\", parallel ) );
+
+        parallel.permissive = true;
+        TEST( b.parse( "[1, 2, 3, 4, 5,, 7, 8, 9, 10, 11, 12,]", parallel ) && b.size() == 12 );
+        TEST( b.has<Null>(5) );
+        parallel.comments = true;
+        TEST( b.parse( "[1, 2, // 3, \"\n 4, 5, 6, 7, 8, '9, ]', 10, 11, 12]", parallel ) && b.size() == 11 );
+        TEST( b.get<String>(7) == "9, ]" );
+
+        parallel.permissive = false;
+        parallel.max_depth = 2;
+        TEST( !b.parse( "[[1], [2], [3], [4], [5], [[6]], [7], [8], [9], [10], [11], [12]]", parallel ) );
+        TEST( b.parse( "[[1], [2], [3], [4], [5], [6], [7], [8], [9], [10], [11], [12]]", parallel ) );
+        TEST( b.size() == 12 && b.get<Array>(11).get<Number>(0) == 12 );
+    }
+
+    {
+        // the push parser gives the same document whichever way the input
+        // is cut, even inside strings, escapes, numbers and literals
+        const string text = " {\"k\\u00e9y\": [1.5e-3, -20, \"a\\\"b\\\\c\\ud83d\\ude00\", true, false, null],"
+                            " \"o\": {\"x\": {}, \"y\": [[]]}, \"n\": 12345678} ";
+        Object whole;
+        TEST( whole.parse( text ) );
+        for( size_t cut = 0; cut <= text.size(); ++cut ) {
+            Object o;
+            PushParser parser( o );
+            TEST( parser.feed( text.data(), cut ) );
+            TEST( parser.feed( text.data() + cut, text.size() - cut ) );
+            TEST( parser.finish() && o.json() == whole.json() );
+        }
+        Object bytes;
+        PushParser parser( bytes );
+        for( size_t i = 0; i < text.size(); ++i )
+            TEST( parser.feed( &text[i], 1 ) );
+        TEST( parser.done() && parser.finish() && bytes.json() == whole.json() );
+
+        // numbers and bare words may end with the input
+        Value v;
+        PushParser number( v );
+        TEST( number.feed( "12", 2 ) && number.feed( "34", 2 ) && !number.done() );
+        TEST( number.finish() && v.get<Number>() == 1234 );
+        ParseOptions options;
+        options.permissive = options.comments = options.unquoted_keys = true;
+        Object loose;
+        PushParser comments( loose, options );
+        TEST( comments.feed( "{ke", 3 ) && comments.feed( "y: 'v', // no", 13 ) );
+        TEST( comments.feed( "te\n}", 4 ) && comments.done() && loose.get<String>("key") == "v" );
+
+        // bad input shows as soon as it arrives
+        Array a;
+        PushParser bad( a );
+        TEST( bad.feed( "[1, ", 4 ) );
+        TEST( !bad.feed( "}", 1 ) && !bad.finish() );
+        PushParser cut( a );
+        TEST( cut.feed( "[1, 2", 5 ) && !cut.finish() );
+        Object not_object;
+        PushParser wrong( not_object );
+        TEST( !wrong.feed( "  [", 3 ) );
+    }
+
+#if JSONXX_COMPILER_HAS_COROUTINES
+    {
+        // many parses share one loop thread, each suspended while its
+        // source has nothing to give
+        const string text = "{\"k\\u00e9y\": [1.5e-3, -20, \"a\\\"b\\\\c\", true, false, null],"
+                            " \"o\": {\"x\": {}, \"y\": [[]]}, \"n\": 12345678}";
+        Object whole;
+        TEST( whole.parse( text ) );
+
+        Loop loop;
+        std::deque<Fragments> sources;
+        std::deque<Object> targets;
+        std::deque<AsyncParse> parses;
+        for( unsigned i = 0; i < 1000; ++i ) {
+            sources.emplace_back( loop, text, i );
+            targets.emplace_back();
+            parses.push_back( parse_async( sources.back(), targets.back() ) );
+            parses.back().start();
+            TEST( !parses.back().done() );
+        }
+        loop.run();
+        for( size_t i = 0; i < parses.size(); ++i )
+            TEST( parses[i].done() && parses[i].result() && targets[i].json() == whole.json() );
+
+        // parses can be awaited from other coroutines
+        Fragments a( loop, text, 1 ), b( loop, "[1, [2, 3]]", 2 );
+        Object x;
+        Array y;
+        AsyncParse both = parse_both( a, x, b, y );
+        both.start();
+        loop.run();
+        TEST( both.done() && both.result() && x.json() == whole.json() && y.size() == 2 );
+
+        // bad input ends the parse early; errors from the source come back
+        Fragments bad( loop, "[1, 2}" + text, 3 );
+        AsyncParse failed = parse_async( bad, y );
+        failed.start();
+        loop.run();
+        TEST( failed.done() && !failed.result() && bad.at < bad.text.size() );
+        struct Broken {
+            struct Read {
+                bool await_ready() const { return true; }
+                void await_suspend( std::coroutine_handle<> ) {}
+                std::string_view await_resume() { throw std::runtime_error( "connection reset" ); }
+            };
+            Read read() { return Read(); }
+        } broken;
+        AsyncParse thrown = parse_async( broken, y );
+        thrown.start();
+        bool caught = false;
+        try { thrown.result(); } catch( const std::runtime_error & ) { caught = true; }
+        TEST( thrown.done() && caught );
+    }
+#endif
+
+    {
+        // copies share their values until one side changes, and then only
+        // the path to the change is copied
+        Object base;
+        TEST( base.parse( "{\"server\": {\"port\": 80, \"hosts\": [\"a\", \"b\"]},"
+                          " \"limits\": {\"rate\": 10}, \"name\": \"base\"}" ) );
+        const string before = base.json();
+        Object copy( base );
+        const Object &shared = copy, &original = base;
+        TEST( &shared.kv_map() == &original.kv_map() );
+
+        copy.get<Object>("server").get<Array>("hosts") << "c";
+        copy << "name" << "copy";
+        TEST( base.json() == before );
+        TEST( copy.get<Object>("server").get<Array>("hosts").size() == 3 && copy.get<String>("name") == "copy" );
+        TEST( &shared.get<Object>("limits").kv_map() == &original.get<Object>("limits").kv_map() );
+        TEST( &shared.get<Object>("server").kv_map() != &original.get<Object>("server").kv_map() );
+
+        // references handed out stay private to their object
+        Object owner( base );
+        Number &port = owner.get<Object>("server").get<Number>("port");
+        Object later( owner );
+        port = 8080;
+        TEST( later.get<Object>("server").get<Number>("port") == 80 );
+        TEST( owner.get<Object>("server").get<Number>("port") == 8080 );
+        // and so do values reached through kv_map() and values()
+        Object holder( base );
+        Value *rate = holder.get<Object>("limits").kv_map().find("rate")->second;
+        Object held( holder );
+        *rate = 0;
+        TEST( held.get<Object>("limits").get<Number>("rate") == 10 && holder.get<Object>("limits").get<Number>("rate") == 0 );
+        // even after the object changes through its own interface
+        Object changed;
+        changed << "a" << 1;
+        Number &a = changed.get<Number>("a");
+        changed << "b" << 2;
+        Object after( changed );
+        a = 42;
+        TEST( after.get<Number>("a") == 1 && changed.get<Number>("a") == 42 );
+
+        // copying leaked containers takes no recursion, however deep, and
+        // changing one through its own interface does not let copies share
+        // it again
+        Object chain;
+        Object *level = &chain;
+        for( int i = 0; i < 200000; ++i ) {
+            *level << "k" << Object();
+            level = &level->get<Object>("k");
+        }
+        Object deep( chain );
+        const Object &deep_view = deep, &chain_view = chain;
+        TEST( &deep_view.kv_map() != &chain_view.kv_map() && deep.hash() == chain.hash() );
+        chain << "n" << 1;
+        Object again( chain );
+        const Object &again_view = again;
+        TEST( &again_view.kv_map() != &chain_view.kv_map() );
+
+        // copies through values, imports and assignments from within
+        Value v( base );
+        v.get<Object>().get<Object>("limits") << "rate" << 20;
+        TEST( base.json() == before && v.get<Object>().get<Object>("limits").get<Number>("rate") == 20 );
+        Array list;
+        list << base << base;
+        list.get<Object>(1) << "extra" << true;
+        TEST( list.get<Object>(0).json() == before && list.get<Object>(1).size() == 4 );
+        list.import( list );
+        list.append( list );
+        TEST( list.size() == 5 && list.get<Array>(4).size() == 4 && list.get<Object>(3).has<Boolean>("extra") );
+        Object self( base );
+        self.import( self );
+        TEST( self.json() == before );
+        self = self.get<Object>("server");
+        TEST( self.size() == 2 && self.get<Number>("port") == 80 );
+        Array inner( list );
+        inner = inner.get<Array>(4);
+        TEST( inner.size() == 4 && list.size() == 5 );
+
+        // parsing into a copy leaves the original alone
+        Object reparsed( base );
+        TEST( reparsed.parse( "{\"x\": 1}" ) && reparsed.size() == 1 && base.json() == before );
+    }
+
+    {
+        // threads may copy, change and drop copies of a shared document
+        Array doc;
+        for( int i = 0; i < 100; ++i )
+            doc << Object( "n", i );
+        const Array &shared = doc;
+        std::vector<std::thread> threads;
+        std::atomic<int> bad( 0 );
+        for( int t = 0; t < 4; ++t )
+            threads.push_back( std::thread( [&shared, &bad] {
+                for( int i = 0; i < 200; ++i ) {
+                    Array copy( shared );
+                    copy.get<Object>( i % 100 ) << "n" << -1;
+                    Array again( copy );
+                    if( shared.get<Object>( i % 100 ).get<Number>("n") != i % 100 ||
+                        again.get<Object>( i % 100 ).get<Number>("n") != -1 )
+                        ++bad;
+                }
+            } ) );
+        for( size_t t = 0; t < threads.size(); ++t )
+            threads[t].join();
+        TEST( bad == 0 );
+    }
+
+    {
+        // readers always see a whole snapshot while a writer reloads
+        SnapshotHolder holder;
+        TEST( holder.load().empty() );
+        TEST( holder.reload( "{\"version\": 0, \"twice\": 0}" ) );
+        TEST( !holder.reload( "{\"version\": " ) && holder.load().get<Number>("version") == 0 );
+
+        std::atomic<bool> stop( false );
+        std::atomic<int> torn( 0 ), reads( 0 );
+        std::vector<std::thread> readers;
+        for( int t = 0; t < 4; ++t )
+            readers.push_back( std::thread( [&] {
+                while( !stop ) {
+                    const Snapshot config = holder.load();
+                    if( config.get<Number>("twice") != 2 * config.get<Number>("version") ||
+                        config.get<Boolean>("missing", true) != true )
+                        ++torn;
+                    ++reads;
+                }
+            } ) );
+        for( int version = 1; version <= 200; ++version ) {
+            const string next = "{\"version\": " + std::to_string( version ) +
+                                ", \"twice\": " + std::to_string( 2 * version ) + "}";
+            istringstream input( next );
+            TEST( version % 2 ? holder.reload( next ) : holder.reload( input ) );
+        }
+        while( reads < 1000 )
+            std::this_thread::yield();
+        stop = true;
+        for( size_t t = 0; t < readers.size(); ++t )
+            readers[t].join();
+        TEST( torn == 0 && holder.load().get<Number>("version") == 200 );
+
+        // a snapshot outlives its replacement, and copies share a document
+        Object doc;
+        doc << "port" << 80;
+        Snapshot old( doc );
+        holder.store( old );
+        doc << "port" << 8080;
+        holder.reload( "{}" );
+        Snapshot copy = old;
+        TEST( old.get<Number>("port") == 80 && &copy.root() == &old.root() && holder.load().empty() );
+    }
+
+    {
+        // JSON Patch, after the examples of RFC 6902 appendix A
+        struct Case { const char *document, *patch, *result; } cases[] = {
+            { "{\"foo\": \"bar\"}", "[{\"op\": \"add\", \"path\": \"/baz\", \"value\": \"qux\"}]",
+              "{\"baz\": \"qux\", \"foo\": \"bar\"}" },
+            { "{\"foo\": [\"bar\", \"baz\"]}", "[{\"op\": \"add\", \"path\": \"/foo/1\", \"value\": \"qux\"}]",
+              "{\"foo\": [\"bar\", \"qux\", \"baz\"]}" },
+            { "{\"baz\": \"qux\", \"foo\": \"bar\"}", "[{\"op\": \"remove\", \"path\": \"/baz\"}]", "{\"foo\": \"bar\"}" },
+            { "{\"foo\": [\"bar\", \"qux\", \"baz\"]}", "[{\"op\": \"remove\", \"path\": \"/foo/1\"}]",
+              "{\"foo\": [\"bar\", \"baz\"]}" },
+            { "{\"baz\": \"qux\", \"foo\": \"bar\"}", "[{\"op\": \"replace\", \"path\": \"/baz\", \"value\": \"boo\"}]",
+              "{\"baz\": \"boo\", \"foo\": \"bar\"}" },
+            { "{\"foo\": {\"bar\": \"baz\", \"waldo\": \"fred\"}, \"qux\": {\"corge\": \"grault\"}}",
+              "[{\"op\": \"move\", \"from\": \"/foo/waldo\", \"path\": \"/qux/thud\"}]",
+              "{\"foo\": {\"bar\": \"baz\"}, \"qux\": {\"corge\": \"grault\", \"thud\": \"fred\"}}" },
+            { "{\"foo\": [\"all\", \"grass\", \"cows\", \"eat\"]}", "[{\"op\": \"move\", \"from\": \"/foo/1\", \"path\": \"/foo/3\"}]",
+              "{\"foo\": [\"all\", \"cows\", \"eat\", \"grass\"]}" },
+            { "{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}",
+              "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"qux\"}, {\"op\": \"test\", \"path\": \"/foo/1\", \"value\": 2}]",
+              "{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}" },
+            { "{\"foo\": \"bar\"}", "[{\"op\": \"add\", \"path\": \"/child\", \"value\": {\"grandchild\": {}}}]",
+              "{\"child\": {\"grandchild\": {}}, \"foo\": \"bar\"}" },
+            { "{\"foo\": [\"bar\"]}", "[{\"op\": \"add\", \"path\": \"/foo/-\", \"value\": [\"abc\", \"def\"]}]",
+              "{\"foo\": [\"bar\", [\"abc\", \"def\"]]}" },
+            { "{\"/\": 9, \"~1\": 10}", "[{\"op\": \"test\", \"path\": \"/~01\", \"value\": 10}, {\"op\": \"copy\", \"from\": \"/~1\", \"path\": \"/c\"}]",
+              "{\"/\": 9, \"c\": 9, \"~1\": 10}" },
+            { "{\"a\": {\"b\": [1, {\"c\": 2}]}}", "[{\"op\": \"replace\", \"path\": \"\", \"value\": {\"d\": 3}}]", "{\"d\": 3}" },
+        };
+        for( size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i ) {
+            Object document, result;
+            Array operations;
+            TEST( document.parse( cases[i].document ) && operations.parse( cases[i].patch ) && result.parse( cases[i].result ) );
+            TEST( patch( document, operations ) );
+            TEST( document.json() == result.json() );
+        }
+
+        const char *const failures[] = {
+            "[{\"op\": \"add\", \"path\": \"/baz/bat\", \"value\": \"qux\"}]",            // no parent
+            "[{\"op\": \"test\", \"path\": \"/foo\", \"value\": \"baz\"}]",              // test fails
+            "[{\"op\": \"add\", \"path\": \"/arr/3\", \"value\": 1}]",                   // past the end
+            "[{\"op\": \"add\", \"path\": \"/arr/01\", \"value\": 1}]",                  // leading zero
+            "[{\"op\": \"remove\", \"path\": \"/arr/-\"}]",
+            "[{\"op\": \"replace\", \"path\": \"/none\", \"value\": 1}]",
+            "[{\"op\": \"move\", \"from\": \"/arr\", \"path\": \"/arr/0\"}]",            // into itself
+            "[{\"op\": \"add\", \"path\": \"foo\", \"value\": 1}]",                       // not a pointer
+            "[{\"op\": \"add\", \"path\": \"/~2\", \"value\": 1}]",
+            "[{\"op\": \"add\", \"path\": \"/x\"}]",                                     // no value
+            "[{\"op\": \"frob\", \"path\": \"/foo\"}]",
+            "[{\"op\": \"replace\", \"path\": \"\", \"value\": [1]}]",                    // an object stays one
+            "[{\"op\": \"remove\", \"path\": \"\"}]",
+            "[{\"op\": \"move\", \"from\": \"/foo\", \"path\": \"/nope/x\"}]",       // a failed move
+            "[{\"op\": \"move\", \"from\": \"/foo\", \"path\": \"\"}]",              // keeps its value
+            "[{\"op\": \"move\", \"from\": \"/arr/0\", \"path\": \"/arr/2\"}]",      // where it was
+            "[1]",
+        };
+        for( size_t i = 0; i < sizeof(failures) / sizeof(failures[0]); ++i ) {
+            Object document;
+            Array operations;
+            TEST( document.parse( "{\"foo\": \"bar\", \"arr\": [1, 2]}" ) && operations.parse( failures[i] ) );
+            const string before = document.json();
+            TEST( !patch( document, operations ) && document.json() == before );
+        }
+
+        // operations before a failure stay applied; a copy keeps the original
+        Object document;
+        Array operations;
+        TEST( document.parse( "{\"a\": 1}" ) );
+        TEST( operations.parse( "[{\"op\": \"add\", \"path\": \"/b\", \"value\": 2}, {\"op\": \"remove\", \"path\": \"/c\"}]" ) );
+        Object attempt( document );
+        TEST( !patch( attempt, operations ) && attempt.size() == 2 && document.size() == 1 );
+
+        // only the path to a change is copied, and move relinks its value
+        Object big;
+        TEST( big.parse( "{\"left\": {\"deep\": [1, 2, 3]}, \"right\": {\"x\": {\"y\": \"z\"}}}" ) );
+        Object changed( big );
+        const Object &original = big;
+        const Value *moving = original.get<Object>("right").kv_map().find("x")->second;
+        TEST( operations.parse( "[{\"op\": \"move\", \"from\": \"/right/x\", \"path\": \"/left/x\"}]" ) );
+        TEST( patch( changed, operations ) );
+        const Object &after = changed;
+        TEST( &after.get<Object>("left").get<Object>("x").kv_map() == &moving->get<Object>().kv_map() );
+        TEST( &after.get<Object>("left").get<Array>("deep").values() == &original.get<Object>("left").get<Array>("deep").values() );
+        TEST( original.get<Object>("right").has<Object>("x") && !after.get<Object>("right").has<Object>("x") );
+
+        // arrays and values take patches too
+        Array list;
+        TEST( list.parse( "[1, 2, 3]" ) );
+        TEST( operations.parse( "[{\"op\": \"remove\", \"path\": \"/0\"}, {\"op\": \"add\", \"path\": \"/-\", \"value\": 4}]" ) );
+        TEST( patch( list, operations ) && list.size() == 3 && list.get<Number>(0) == 2 && list.get<Number>(2) == 4 );
+        Value scalar( 1 );
+        TEST( operations.parse( "[{\"op\": \"replace\", \"path\": \"\", \"value\": \"now a string\"}]" ) );
+        TEST( patch( scalar, operations ) && scalar.get<String>() == "now a string" );
+    }
+
+    {
+        // JSON Merge Patch, the examples of RFC 7386 appendix A
+        const char *const cases[][3] = {
+            { "{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}" },
+            { "{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}" },
+            { "{\"a\":\"b\"}", "{\"a\":null}", "{}" },
+            { "{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}" },
+            { "{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}" },
+            { "{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":[\"b\"]}" },
+            { "{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}" },
+            { "{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}", "{\"a\":[1]}" },
+            { "[\"a\",\"b\"]", "[\"c\",\"d\"]", "[\"c\",\"d\"]" },
+            { "{\"a\":\"b\"}", "[\"c\"]", "[\"c\"]" },
+            { "{\"a\":\"foo\"}", "null", "null" },
+            { "{\"a\":\"foo\"}", "\"bar\"", "\"bar\"" },
+            { "{\"e\":null}", "{\"a\":1}", "{\"a\":1,\"e\":null}" },
+            { "[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}" },
+            { "{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}" },
+        };
+        for( size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i ) {
+            Value document, changes, result;
+            TEST( document.parse( cases[i][0] ) && changes.parse( cases[i][1] ) && result.parse( cases[i][2] ) );
+            merge_patch( document, changes );
+            ostringstream got, want;
+            got << document;
+            want << result;
+            TEST( got.str() == want.str() );
+        }
+
+        Object config, changes;
+        TEST( config.parse( "{\"server\": {\"port\": 80, \"host\": \"a\"}, \"limits\": {\"rate\": 10}}" ) );
+        TEST( changes.parse( "{\"server\": {\"port\": 8080, \"host\": null}}" ) );
+        Object merged( config );
+        merge_patch( merged, changes );
+        TEST( merged.get<Object>("server").size() == 1 && merged.get<Object>("server").get<Number>("port") == 8080 );
+        TEST( config.get<Object>("server").size() == 2 );
+        const Object &shared = merged, &original = config;
+        TEST( &shared.get<Object>("limits").kv_map() == &original.get<Object>("limits").kv_map() );
+    }
+
+    {
+        // a diff patches one document into the other
+        Object from, to;
+        TEST( from.parse( "{\"a\": 1, \"b\": [1, 2, 3, 4, 5], \"c\": {\"d\": \"e\", \"f\": [true]}, \"g~/\": null}" ) );
+        TEST( to.parse( "{\"a\": 1, \"b\": [0, 1, 2, 4, 5, 6], \"c\": {\"d\": \"x\", \"f\": [true], \"h\": {}}, \"i\": []}" ) );
+        Array operations = diff( from, to );
+        Object patched( from );
+        TEST( patch( patched, operations ) && patched.json() == to.json() );
+        TEST( diff( to, to ).empty() && diff( from, Object( from ) ).empty() );
+
+        // unchanged runs of elements cost nothing, shared containers are skipped
+        Array before, after;
+        for( int i = 0; i < 100; ++i )
+            before << Object( "n", i );
+        after = before;
+        after.import( Object( "n", -1 ) );
+        TEST( diff( before, after ).size() == 1 );
+        Array rotated;
+        rotated.import( before.get<Object>(99) );
+        for( int i = 0; i < 99; ++i )
+            rotated.import( before.get<Object>(i) );
+        operations = diff( before, rotated );
+        TEST( operations.size() == 2 && operations.get<Object>(0).get<String>("op") == "add" &&
+              operations.get<Object>(1).get<String>("op") == "remove" );
+        Array patched_array( before );
+        TEST( patch( patched_array, operations ) && patched_array.json() == rotated.json() );
+
+        Value scalar( 1 ), text( "one" );
+        operations = diff( scalar, text );
+        TEST( operations.size() == 1 && patch( scalar, operations ) && scalar.get<String>() == "one" );
+
+        // and on random documents changed at random
+        std::mt19937 random( 7 );
+        struct Random {
+            static Value document( std::mt19937 &random, int depth ) {
+                switch( random() % ( depth > 3 ? 4 : 6 ) ) {
+                    case 0: return Value( int( random() % 5 ) );
+                    case 1: return Value( random() % 2 ? "x" : "y/~" );
+                    case 2: return Value( random() % 2 == 0 );
+                    case 3: return Value( Null() );
+                    case 4: {
+                        Array a;
+                        for( size_t i = 0, n = random() % 6; i < n; ++i )
+                            a << document( random, depth + 1 );
+                        return Value( a );
+                    }
+                    default: {
+                        Object o;
+                        for( size_t i = 0, n = random() % 6; i < n; ++i )
+                            o << string( 1, char( 'a' + random() % 5 ) ) << document( random, depth + 1 );
+                        return Value( o );
+                    }
+                }
+            }
+            static void change( std::mt19937 &random, Value &v, int depth ) {
+                if( v.is<Array>() && v.get<Array>().size() && random() % 3 ) {
+                    const Array &a = v.get<Array>();
+                    Array b;
+                    for( size_t i = 0; i < a.size(); ++i ) {
+                        if( random() % 4 == 0 ) continue;
+                        Value e( *a.values()[i] );
+                        if( random() % 4 == 0 ) change( random, e, depth + 1 );
+                        b << e;
+                        if( random() % 5 == 0 ) b << document( random, depth + 1 );
+                    }
+                    v = b;
+                } else if( v.is<Object>() && random() % 3 ) {
+                    Object &o = v.get<Object>();
+                    const string key( 1, char( 'a' + random() % 6 ) );
+                    if( o.has<Value>( key ) && random() % 2 )
+                        change( random, o.get<Value>( key ), depth + 1 );
+                    else
+                        o << key << document( random, depth + 1 );
+                } else {
+                    v = document( random, depth );
+                }
+            }
+        };
+        for( int round = 0; round < 500; ++round ) {
+            Value a( Random::document( random, 0 ) ), b( a );
+            for( int changes = random() % 4; changes >= 0; --changes )
+                Random::change( random, b, 0 );
+            Value patched( a );
+            ostringstream want, got;
+            want << b;
+            TEST( patch( patched, diff( a, b ) ) );
+            got << patched;
+            TEST( got.str() == want.str() );
+        }
+    }
+
+    {
+        // equality and hashes ignore the order members were added in
+        Object a, b;
+        a << "x" << 1 << "y" << Array() << "z" << "text";
+        b << "z" << "text" << "x" << 1.0 << "y" << Array();
+        TEST( a == b && !( a != b ) && a.hash() == b.hash() );
+        b << "y" << ( Array() << Null() );
+        TEST( a != b && a.hash() != b.hash() );
+        TEST( Value( 0 ) == Value( -0.0 ) && Value( 0 ).hash() == Value( -0.0 ).hash() );
+        TEST( Value( 1 ) != Value( "1" ) && Value( true ) != Value( 1 ) && Value( Null() ) == Value( Null() ) );
+        TEST( Value( a ) == Value( Object( a ) ) && Value( a ).hash() == a.hash() );
+        Array list, other;
+        list << 1 << "two" << a;
+        other << 1 << "two" << b;
+        TEST( list != other && list == Array( list ) && list.hash() != other.hash() );
+
+        // kept hashes are reused, and dropped by any change below them
+        const string text = "{\"a\": {\"b\": [1, 2, {\"c\": \"d\"}]}, \"e\": [[], {}]}";
+        Object cached, fresh;
+        TEST( cached.parse( text ) && fresh.parse( text ) );
+        TEST( cached.hash( true ) == fresh.hash() && cached == fresh );
+        Object copy( cached );
+        TEST( copy.hash() == cached.hash() );
+        cached.get<Object>("a").get<Array>("b").get<Object>(2) << "c" << "changed";
+        TEST( cached.hash( true ) != fresh.hash() && cached != fresh );
+        TEST( fresh.parse( "{\"a\": {\"b\": [1, 2, {\"c\": \"changed\"}]}, \"e\": [[], {}]}" ) );
+        TEST( cached.hash() == fresh.hash() && cached == fresh );
+        TEST( copy.hash() != cached.hash() && copy != cached );
+
+        Object patched;
+        TEST( patched.parse( text ) );
+        const size_t before = patched.hash( true );
+        Array operations;
+        TEST( operations.parse( "[{\"op\": \"add\", \"path\": \"/e/0/-\", \"value\": 3}]" ) );
+        TEST( patch( patched, operations ) && patched.hash( true ) != before );
+        TEST( fresh.parse( "{\"a\": {\"b\": [1, 2, {\"c\": \"d\"}]}, \"e\": [[3], {}]}" ) );
+        TEST( patched.hash() == fresh.hash() && patched == fresh );
+
+        // and are never kept above values a get() reference may change,
+        // wherever those values are moved
+        Object held;
+        TEST( held.parse( "{\"a\": {\"k\": 1}, \"b\": {}}" ) );
+        Number &k = held.get<Object>("a").get<Number>("k");
+        TEST( operations.parse( "[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"/b/a\"}]" ) && patch( held, operations ) );
+        const Object &view = held;
+        const size_t kept = view.get<Object>("b").hash( true );
+        TEST( fresh.parse( "{\"b\": {\"a\": {\"k\": 2}}}" ) && fresh.hash( true ) );
+        k = 2;
+        TEST( view.get<Object>("b").hash( true ) != kept && view.hash( true ) == fresh.hash() && held == fresh );
+
+        // assignment copies, even from inside the value assigned to
+        Value v( 1 ), w( Object( "k", Array() << 5 ) );
+        v = w;
+        w.get<Object>().get<Array>("k") << 6;
+        TEST( v.get<Object>().get<Array>("k").size() == 1 && v != w );
+        v = v.get<Object>().get<Value>("k");
+        TEST( v.is<Array>() && v.get<Array>().get<Number>(0) == 5 );
+        v = v;
+        TEST( v.is<Array>() && v.get<Array>().size() == 1 );
+    }
+
+    {
+        // parsed documents are reused for input seen before
+        ParseCache cache( 2, 1 );
+        const string text = "{\"a\": [1, 2, {\"b\": \"c\"}]}";
+        Object first, second;
+        TEST( cache.parse( text, first ) && cache.parse( text, second ) );
+        ParseCache::Stats stats = cache.stats();
+        TEST( stats.hits == 1 && stats.misses == 1 && stats.size == 1 && first == second );
+        const Object &shared = second, &original = first;
+        TEST( &shared.kv_map() == &original.kv_map() );
+
+        // what is handed out may change without reaching the cache
+        first.get<Array>("a") << 3;
+        Object third;
+        TEST( cache.parse( text, third ) && third == second && third != first );
+
+        // the kind of document and the options are part of the key
+        Value value;
+        TEST( cache.parse( text, value ) && value.is<Object>() && value.get<Object>() == second );
+        ParseOptions strict;
+        strict.permissive = false;
+        TEST( !cache.parse( "[1, 2,]", value, strict ) && cache.parse( "[1, 2,]", value ) );
+        Value plain;
+        TEST( value.get<Array>().size() == 2 && cache.parse( text + "]", value ) == plain.parse( text + "]" ) );
+        TEST( !cache.parse( "[1]", third ) && !cache.parse( "{", value ) );
+
+        // least recently used documents go first
+        cache.clear();
+        const unsigned long long evictions = cache.stats().evictions;
+        TEST( cache.stats().size == 0 );
+        Value a, b, c;
+        TEST( cache.parse( "1", a ) && cache.parse( "2", b ) && cache.parse( "1", a ) && cache.parse( "3", c ) );
+        stats = cache.stats();
+        TEST( stats.evictions == evictions + 1 && stats.size == 2 );
+        TEST( cache.parse( "1", a ) && cache.stats().hits == stats.hits + 1 );
+        TEST( cache.parse( "2", b ) && cache.stats().misses == stats.misses + 1 && a.get<Number>() == 1 );
+
+        // the same input parsed as different kinds, or with different
+        // options, is cached once for each
+        ParseCache kinds( 4, 1 );
+        Object as_object;
+        TEST( kinds.parse( text, as_object ) && kinds.parse( text, value ) && kinds.parse( text, value, strict ) );
+        stats = kinds.stats();
+        TEST( kinds.parse( text, as_object ) && kinds.parse( text, value ) && kinds.parse( text, value, strict ) );
+        TEST( kinds.stats().hits == stats.hits + 3 && kinds.stats().size == 3 && kinds.stats().evictions == 0 );
+
+        // the capacity bounds the whole cache, however many shards
+        ParseCache small( 4, 16 );
+        for( int i = 0; i < 100; ++i )
+            TEST( small.parse( std::to_string( i ), value ) );
+        TEST( small.stats().size <= 4 );
+
+        // threads share the cache
+        ParseCache shared_cache( 64 );
+        std::vector<std::thread> threads;
+        std::atomic<int> bad( 0 );
+        for( int t = 0; t < 4; ++t )
+            threads.push_back( std::thread( [&shared_cache, &bad, t] {
+                for( int i = 0; i < 2000; ++i ) {
+                    const int n = ( i * 7 + t ) % 100;
+                    Object o;
+                    if( !shared_cache.parse( "{\"n\": " + std::to_string( n ) + "}", o ) || o.get<Number>("n") != n )
+                        ++bad;
+                    o << "mine" << t;
+                }
+            } ) );
+        for( size_t t = 0; t < threads.size(); ++t )
+            threads[t].join();
+        stats = shared_cache.stats();
+        TEST( bad == 0 && stats.hits + stats.misses == 8000 && stats.size <= 64 && stats.evictions > 0 );
+    }
+
+    {
+        // calls made while a scope is open count into its Stats
+        const string text = "{\"a\": [1, \"x\\ny\", true, null, {\"b\": \"\\u00e9 & co\"}], \"c\": false}";
+        Stats read;
+        Object o;
+        {
+            StatsScope scope( read, ticks );
+            TEST( o.parse( text ) );
+        }
+        TEST( read.calls == 1 && read.bytes_read == text.size() && read.bytes_written == 0 );
+        TEST( read.objects == 2 && read.arrays == 1 && read.strings == 2 && read.numbers == 1 );
+        TEST( read.booleans == 2 && read.nulls == 1 && read.keys == 3 && read.max_depth == 3 );
+        TEST( read.escapes_read == 2 && read.escapes_written == 0 && read.allocations == 1 );
+
+        // and nothing once it is closed
+        TEST( o.parse( text ) && read.calls == 1 );
+
+        Stats checked, written, converted, xml_written;
+        {
+            StatsScope scope( checked );
+            TEST( validate( text ) );
+            {
+                StatsScope inner( written );
+                const string out = o.json();
+                TEST( written.bytes_written == out.size() );
+                o.xml( JSONx );
+            }
+            TEST( reformat( text ).size() > 0 );
+        }
+        // reformat() of text counts as the parse and the write it is made of
+        TEST( checked.calls == 3 && checked.bytes_read == 2 * text.size() && checked.escapes_read == 4 );
+        TEST( checked.keys == 9 && checked.max_depth == 3 && checked.allocations == 0 );
+        TEST( checked.bytes_written == reformat( text ).size() && checked.escapes_written == 1 );
+        TEST( written.calls == 2 && written.bytes_read == 0 && written.keys == 6 && written.strings == 4 );
+        // "\n" in JSON, "&" in XML
+        TEST( written.escapes_written == 2 && written.escapes_read == 0 );
+        {
+            StatsScope scope( converted );
+            TEST( xml( text, JSONx ) == o.xml( JSONx ) );
+        }
+        // xml() from text counts as the parse and the write it is made of
+        TEST( converted.calls == 3 && converted.escapes_read == 2 && converted.escapes_written == 2 );
+        TEST( converted.bytes_written == 2 * o.xml( JSONx ).size() );
+        {
+            std::ostringstream out;
+            StatsScope scope( xml_written );
+            o.xml( out, TaggedXML );
+            o.json( out );
+            TEST( xml_written.bytes_written == out.str().size() );
+        }
+
+        // calls made on worker threads count too, once
+        Array big;
+        ParseOptions parallel;
+        parallel.threads = 4;
+        parallel.min_parallel = 0;
+        string many = "[";
+        for( int i = 0; i < 200; ++i )
+            many += ( i ? "," : "" ) + text;
+        many += "]";
+        Stats serial, threaded;
+        {
+            StatsScope scope( serial );
+            TEST( big.parse( many ) );
+        }
+        {
+            StatsScope scope( threaded );
+            TEST( big.parse( many, parallel ) && big.size() == 200 );
+        }
+        TEST( serial.calls == 1 && threaded.calls == 1 && threaded.bytes_read == many.size() );
+        TEST( threaded.objects == serial.objects && threaded.arrays == serial.arrays && threaded.arrays == 201 );
+        TEST( threaded.keys == serial.keys && threaded.escapes_read == serial.escapes_read && threaded.escapes_read == 400 );
+        TEST( threaded.max_depth == 4 && serial.max_depth == 4 );
+    }
+
+    {
+        // memory_usage() counts every value once, by type
+        const string text = "{\"a\": [1, 2.5, \"short\", true, null, {\"b\": false}], \"long\": \"" + string( 1000, 'x' ) + "\"}";
+        Object o;
+        Stats stats;
+        {
+            StatsScope scope( stats );
+            TEST( o.parse( text ) );
+        }
+        MemoryUsage usage = o.memory_usage();
+        TEST( usage.objects.count == stats.objects && usage.arrays.count == stats.arrays );
+        TEST( usage.strings.count == stats.strings && usage.numbers.count == stats.numbers );
+        TEST( usage.booleans.count == stats.booleans && usage.nulls.count == stats.nulls );
+        TEST( usage.numbers.bytes == 2 * sizeof(Value) && usage.nulls.bytes == sizeof(Value) );
+        TEST( usage.strings.bytes > 1000 + 2 * ( sizeof(Value) + sizeof(String) ) && usage.shared == 0 );
+        TEST( usage.bytes() == usage.objects.bytes + usage.arrays.bytes + usage.strings.bytes +
+                               usage.numbers.bytes + usage.booleans.bytes + usage.nulls.bytes );
+        TEST( Value( 1 ).memory_usage().bytes() == sizeof(Value) && Object().memory_usage().bytes() == sizeof(Object) );
+
+        // what a copy shares counts for both, and shows as shared
+        {
+            Object copy( o );
+            const MemoryUsage copied = copy.memory_usage();
+            TEST( copied.bytes() == usage.bytes() && copied.shared == usage.bytes() - sizeof(Object) );
+            TEST( o.memory_usage().shared == copied.shared );
+            copy << "c" << 3;
+            TEST( copy.memory_usage().shared < copied.shared );
+        }
+        TEST( o.memory_usage().shared == 0 );
+
+        // a container held twice in one document counts once
+        const Array &inner = o.get<Array>("a");
+        Array twice, distinct, reparsed;
+        TEST( reparsed.parse( inner.json() ) && reparsed == inner );
+        const Value held( inner ), other( reparsed );
+        twice << held << held;
+        distinct << held << other;
+        const MemoryUsage once = inner.memory_usage();
+        TEST( twice.memory_usage().arrays.count == 3 && twice.memory_usage().numbers.count == 2 );
+        TEST( distinct.memory_usage().bytes() - twice.memory_usage().bytes() == reparsed.memory_usage().bytes() - sizeof(Array) );
+        TEST( twice.memory_usage().shared == once.bytes() - sizeof(Array) );
+    }
+
     cout << "All tests ok." << endl;
     return 0;
 }